@@ -0,0 +1,213 @@
+/* Async stress benchmark for libusbM
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, please visit www.gnu.org.
+*/
+
+/*
+ * Runs 1, 2, 4.. up to max_threads threads that each keep depth async
+ * reads of size bytes in flight on the simulated benchmark device, and
+ * prints the transfer rate of every round next to the single thread rate.
+ * The simulated device completes reads at once, so the rounds measure the
+ * submit, completion and reap paths of the library itself.
+ *
+ * usage: async_stress [max_threads] [seconds] [depth] [size]
+ */
+
+#include "mpl_threads.h"
+#include <stdio.h>
+#include <string.h>
+#include <usb.h>
+
+#define CONERR(...) printf("Err: " __VA_ARGS__)
+#define CONMSG(...) printf(__VA_ARGS__)
+
+#define MAX_THREADS	64
+#define MAX_DEPTH	64
+
+#define SET_TEST		0x0E
+#define TEST_TYPE_READ	0x01
+#define BENCH_EP		0x81
+
+struct stress_thread
+{
+	MPL_THREAD_T handle;
+	int depth;
+	int size;
+	long transfers;
+	int error;
+};
+
+static usb_dev_handle *g_dev;
+static volatile long g_stop;
+static MPL_SEM_T g_done;
+
+static MPL_THDPROC_RETURN_TYPE MPL_THDPROC_CC StressThreadProc(void *arg)
+{
+	struct stress_thread *t = (struct stress_thread *)arg;
+	void *contexts[MAX_DEPTH];
+	char *buffer;
+	int i, r;
+
+	memset(contexts, 0, sizeof(contexts));
+	if ((buffer = malloc((size_t)t->depth * t->size)) == NULL) {
+		t->error = -ENOMEM;
+		goto Done;
+	}
+
+	for (i = 0; i < t->depth; i++) {
+		if ((r = usb_bulk_setup_async(g_dev, &contexts[i], BENCH_EP)) < 0 ||
+			(r = usb_submit_async(contexts[i], buffer + (i * t->size), t->size)) < 0) {
+			t->error = r;
+			goto Done;
+		}
+	}
+
+	/* reap the oldest transfer and submit it again */
+	for (i = 0; !g_stop; i = (i + 1) % t->depth) {
+		if ((r = usb_reap_async(contexts[i], 5000)) < 0 ||
+			(r = usb_submit_async(contexts[i], buffer + (i * t->size), t->size)) < 0) {
+			t->error = r;
+			break;
+		}
+		t->transfers++;
+	}
+
+Done:
+	for (i = 0; i < t->depth; i++) {
+		if (contexts[i]) {
+			usb_cancel_async(contexts[i]);
+			usb_reap_async(contexts[i], 5000);
+			usb_free_async(&contexts[i]);
+		}
+	}
+	free(buffer);
+	Mpl_Sem_Release(&g_done);
+	return (MPL_THDPROC_RETURN_TYPE)NULL;
+}
+
+/* returns the transfers per second of all threads, or -1 */
+static double RunRound(struct stress_thread *threads, int count, int seconds)
+{
+	long transfers = 0;
+	muint64_t start, elapsed;
+	int i, started = 0;
+
+	g_stop = 0;
+	start = Mpl_Clock_Ticks_Ms();
+	for (i = 0; i < count; i++) {
+		threads[i].transfers = 0;
+		threads[i].error = 0;
+		if (Mpl_Thread_Init(&threads[i].handle, StressThreadProc, &threads[i]) != MPL_SUCCESS) {
+			CONERR("Mpl_Thread_Init failed.\n");
+			break;
+		}
+		started++;
+	}
+
+	MPL_SleepMs(seconds * 1000);
+	g_stop = 1;
+	for (i = 0; i < started; i++)
+		Mpl_Sem_Wait(&g_done);
+	elapsed = Mpl_Clock_Ticks_Ms() - start;
+
+	for (i = 0; i < started; i++) {
+		if (threads[i].error < 0) {
+			CONERR("thread %d failed. ret=%d\n", i, threads[i].error);
+			return -1;
+		}
+		transfers += threads[i].transfers;
+	}
+	if (started < count)
+		return -1;
+	return elapsed ? (transfers * 1000.0) / (double)elapsed : 0;
+}
+
+int main(int argc, char** argv)
+{
+	struct usb_init_params initParams;
+	struct stress_thread threads[MAX_THREADS];
+	struct usb_device *dev;
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	int seconds = argc > 2 ? atoi(argv[2]) : 2;
+	int depth = argc > 3 ? atoi(argv[3]) : 4;
+	int size = argc > 4 ? atoi(argv[4]) : 512;
+	double rate, base = 0;
+	char test_type;
+	int count, i, ret = -1;
+
+	if (max_threads < 1 || max_threads > MAX_THREADS || seconds < 1 ||
+		depth < 1 || depth > MAX_DEPTH || size < 1) {
+		CONMSG("usage: async_stress [max_threads(1-%d)] [seconds] [depth(1-%d)] [size]\n",
+			MAX_THREADS, MAX_DEPTH);
+		return -1;
+	}
+
+	Mpl_Init();
+	memset(&g_done, 0, sizeof(g_done));
+	if (Mpl_Sem_Init(&g_done, 0) != MPL_SUCCESS) {
+		CONERR("Mpl_Sem_Init failed.\n");
+		return -1;
+	}
+
+	memset(&initParams, 0, sizeof(initParams));
+	initParams.size = sizeof(initParams);
+	initParams.backend = USB_BACKEND_SIMULATED;
+	if ((ret = usb_initex(&initParams)) < 0) {
+		CONERR("failed initializing simulated device. ret=%d\n", ret);
+		return -1;
+	}
+	usb_find_busses();
+	usb_find_devices();
+
+	ret = -1;
+	if (!usb_get_busses() || (dev = usb_get_busses()->devices) == NULL ||
+		(g_dev = usb_open(dev)) == NULL) {
+		CONERR("simulated device not found.\n");
+		goto Done;
+	}
+	if (usb_control_msg(g_dev, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN,
+		SET_TEST, TEST_TYPE_READ, 0, &test_type, 1, 1000) != 1) {
+		CONERR("setting the test type failed.\n");
+		goto Done;
+	}
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < MAX_THREADS; i++) {
+		threads[i].depth = depth;
+		threads[i].size = size;
+	}
+
+	CONMSG("threads  transfers/sec  per thread  scaling\n");
+	for (count = 1; ; count *= 2) {
+		if (count > max_threads)
+			count = max_threads;
+		if ((rate = RunRound(threads, count, seconds)) < 0)
+			goto Done;
+		if (count == 1)
+			base = rate;
+		CONMSG("%7d  %13.0f  %10.0f  %6.2fx\n",
+			count, rate, rate / count, base > 0 ? rate / base : 0);
+		if (count == max_threads)
+			break;
+	}
+	ret = 0;
+
+Done:
+	if (g_dev)
+		usb_close(g_dev);
+	usb_exit();
+	Mpl_Sem_Free(&g_done);
+	Mpl_Free();
+	return ret;
+}
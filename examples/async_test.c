@@ -0,0 +1,629 @@
+/* Async API checks for libusbM
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, please visit www.gnu.org.
+*/
+
+/*
+ * Runs the async transfer functions against the simulated benchmark
+ * device and reports each check as passed or failed. The exit code is
+ * the number of failed checks.
+ */
+
+#include "mpl_threads.h"
+#include <stdio.h>
+#include <string.h>
+#include <usb.h>
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <poll.h>
+#endif
+
+#define CONERR(...) printf("Err: " __VA_ARGS__)
+#define CONMSG(...) printf(__VA_ARGS__)
+
+#define SET_TEST		0x0E
+#define GET_TEST		0x0F
+#define TEST_TYPE_READ	0x01
+#define TEST_TYPE_LOOP	0x03
+#define EP_OUT			0x01
+#define EP_IN			0x81
+#define CHUNK			512
+
+static usb_dev_handle *g_dev;
+
+static int set_test_type(int test_type)
+{
+	char reply;
+
+	return usb_control_msg(g_dev, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN,
+		SET_TEST, test_type, 0, &reply, 1, 1000) == 1;
+}
+
+/* loop mode: what one context writes, another reads back */
+static int check_submit_reap(void)
+{
+	char out[CHUNK], in[CHUNK];
+	void *writer = NULL, *reader = NULL;
+	int i, passed = 0;
+
+	for (i = 0; i < CHUNK; i++)
+		out[i] = (char)(i * 7);
+	memset(in, 0, sizeof(in));
+
+	if (!set_test_type(TEST_TYPE_LOOP) ||
+		usb_bulk_setup_async(g_dev, &writer, EP_OUT) < 0 ||
+		usb_bulk_setup_async(g_dev, &reader, EP_IN) < 0)
+		goto Done;
+
+	if (usb_submit_async(writer, out, CHUNK) < 0 ||
+		usb_reap_async(writer, 1000) != CHUNK)
+		goto Done;
+	if (usb_submit_async(reader, in, CHUNK) < 0 ||
+		usb_reap_async(reader, 1000) != CHUNK)
+		goto Done;
+	passed = memcmp(in, out, CHUNK) == 0;
+
+Done:
+	usb_free_async(&writer);
+	usb_free_async(&reader);
+	return passed;
+}
+
+/* four reads on one endpoint reported through one queue, once each and in
+ * the order they were submitted. In loop mode they wait for data, so one
+ * write completes all of them at once */
+static int check_queue(void)
+{
+	struct usb_async_completion completions[4];
+	char buffer[4][CHUNK];
+	char data[4 * CHUNK];
+	void *contexts[4] = {NULL, NULL, NULL, NULL};
+	void *queue = NULL;
+	int reaped = 0, passed = 0;
+	int i, r;
+
+	if (!set_test_type(TEST_TYPE_LOOP) || usb_async_queue_create(&queue, 8) < 0)
+		goto Done;
+
+	for (i = 0; i < 4; i++) {
+		if (usb_bulk_setup_async(g_dev, &contexts[i], EP_IN) < 0 ||
+			usb_async_queue_attach(contexts[i], queue) < 0 ||
+			usb_submit_async(contexts[i], buffer[i], CHUNK) < 0)
+			goto Done;
+	}
+	memset(data, 0, sizeof(data));
+	if (usb_bulk_write(g_dev, EP_OUT, data, sizeof(data), 1000) != (int)sizeof(data))
+		goto Done;
+
+	while (reaped < 4) {
+		if ((r = usb_reap_async_many(queue, completions, 4, 1000)) <= 0)
+			goto Done;
+		for (i = 0; i < r; i++, reaped++) {
+			if (reaped == 4 || completions[i].context != contexts[reaped] ||
+				completions[i].result != CHUNK)
+				goto Done;
+		}
+	}
+	passed = 1;
+
+Done:
+	for (i = 0; i < 4; i++)
+		usb_free_async(&contexts[i]);
+	usb_async_queue_free(&queue);
+	return passed;
+}
+
+/* loop mode with nothing written: the read stays pending until cancelled */
+static int check_cancel(void)
+{
+	char buffer[CHUNK];
+	void *context = NULL;
+	int passed = 0;
+
+	if (!set_test_type(TEST_TYPE_LOOP) ||
+		usb_bulk_setup_async(g_dev, &context, EP_IN) < 0 ||
+		usb_submit_async(context, buffer, CHUNK) < 0)
+		goto Done;
+
+	MPL_SleepMs(10);
+	if (usb_cancel_async(context) < 0)
+		goto Done;
+	passed = usb_reap_async(context, 1000) == -ETIMEDOUT;
+
+Done:
+	usb_free_async(&context);
+	return passed;
+}
+
+/* a freed pool context is handed out again; past the pool size setup
+ * falls back to allocating */
+static int check_pool(void)
+{
+	char buffer[CHUNK];
+	void *a = NULL, *b = NULL, *extra = NULL, *again = NULL;
+	void *freed;
+	int passed = 0;
+
+	if (!set_test_type(TEST_TYPE_READ) || usb_setup_async_pool(g_dev, 2, 0) < 0)
+		return 0;
+
+	if (usb_bulk_setup_async(g_dev, &a, EP_IN) < 0 ||
+		usb_bulk_setup_async(g_dev, &b, EP_IN) < 0 ||
+		usb_bulk_setup_async(g_dev, &extra, EP_IN) < 0)
+		goto Done;
+
+	freed = b;
+	usb_free_async(&b);
+	if (usb_bulk_setup_async(g_dev, &again, EP_IN) < 0 || again != freed)
+		goto Done;
+
+	passed = usb_submit_async(again, buffer, CHUNK) == 0 &&
+		usb_reap_async(again, 1000) == CHUNK &&
+		usb_submit_async(extra, buffer, CHUNK) == 0 &&
+		usb_reap_async(extra, 1000) == CHUNK;
+
+Done:
+	usb_free_async(&a);
+	usb_free_async(&b);
+	usb_free_async(&extra);
+	usb_free_async(&again);
+	return passed;
+}
+
+/* a read stream returns whole chunks; a write stream flushes cleanly */
+static int check_stream(void)
+{
+	char buffer[CHUNK * 4];
+	void *stream = NULL;
+	int i, passed = 0;
+
+	if (!set_test_type(TEST_TYPE_READ) ||
+		usb_stream_open(g_dev, &stream, EP_IN, 4, CHUNK) < 0)
+		return 0;
+	for (i = 0; i < 16; i++) {
+		if (usb_stream_read(stream, buffer, CHUNK, 1000) != CHUNK)
+			goto Done;
+	}
+	usb_stream_close(&stream);
+
+	memset(buffer, 0x5a, sizeof(buffer));
+	if (usb_stream_open(g_dev, &stream, EP_OUT, 4, CHUNK) < 0)
+		return 0;
+	for (i = 0; i < 4; i++) {
+		if (usb_stream_write(stream, buffer, sizeof(buffer), 1000) != (int)sizeof(buffer))
+			goto Done;
+	}
+	passed = usb_stream_flush(stream, 1000) == 0;
+
+Done:
+	usb_stream_close(&stream);
+	return passed;
+}
+
+struct resubmit_state
+{
+	int count;
+	int bad;
+	MPL_EVENT_T stopped;
+};
+
+/* stops the resubmitting after ten completions */
+static int USBAPI_DECL resubmit_cb(void *context, int result, void *user_data)
+{
+	struct resubmit_state *state = (struct resubmit_state *)user_data;
+
+	if (result != CHUNK)
+		state->bad++;
+	if (++state->count < 10)
+		return 0;
+	Mpl_Event_Set(&state->stopped);
+	return 1;
+}
+
+static int check_callback_resubmit(void)
+{
+	struct resubmit_state state;
+	char buffer[CHUNK];
+	void *context = NULL;
+	int passed = 0;
+
+	memset(&state, 0, sizeof(state));
+	if (Mpl_Event_Init(&state.stopped, 0, 0) != MPL_SUCCESS)
+		return 0;
+
+	if (!set_test_type(TEST_TYPE_READ) ||
+		usb_bulk_setup_async(g_dev, &context, EP_IN) < 0 ||
+		usb_async_set_callback(context, resubmit_cb, &state, USB_ASYNC_RESUBMIT) < 0 ||
+		usb_submit_async(context, buffer, CHUNK) < 0)
+		goto Done;
+
+	if (Mpl_Event_Wait(&state.stopped, 1000) != MPL_SUCCESS)
+		goto Done;
+	/* nothing is resubmitted once the callback said stop */
+	MPL_SleepMs(50);
+	passed = state.count == 10 && !state.bad;
+
+Done:
+	usb_free_async(&context);
+	Mpl_Event_Free(&state.stopped);
+	return passed;
+}
+
+/* completions wait in the queue and are reaped at most max at a time; an
+ * empty queue times out */
+static int check_queue_batches(void)
+{
+	struct usb_async_completion completions[4];
+	char buffer[3][CHUNK];
+	void *contexts[3] = {NULL, NULL, NULL};
+	void *queue = NULL;
+	int i, passed = 0;
+
+	if (!set_test_type(TEST_TYPE_READ) || usb_async_queue_create(&queue, 4) < 0)
+		goto Done;
+	for (i = 0; i < 3; i++) {
+		if (usb_bulk_setup_async(g_dev, &contexts[i], EP_IN) < 0 ||
+			usb_async_queue_attach(contexts[i], queue) < 0 ||
+			usb_submit_async(contexts[i], buffer[i], CHUNK) < 0)
+			goto Done;
+	}
+	MPL_SleepMs(50);
+
+	passed = usb_reap_async_many(queue, completions, 2, 1000) == 2 &&
+		usb_reap_async_many(queue, completions, 4, 1000) == 1 &&
+		completions[0].context == contexts[2] && completions[0].result == CHUNK &&
+		usb_reap_async_many(queue, completions, 4, 10) == -ETIMEDOUT;
+
+Done:
+	for (i = 0; i < 3; i++)
+		usb_free_async(&contexts[i]);
+	usb_async_queue_free(&queue);
+	return passed;
+}
+
+/* loop mode: segments that do not end on a packet boundary, split
+ * differently on the way out and back in */
+static int check_vectored(void)
+{
+	char out[4 * CHUNK], in[4 * CHUNK];
+	struct usb_iovec wiov[4] = {
+		{out, 100}, {out + 100, 700}, {out + 800, 1000}, {out + 1800, 248}};
+	struct usb_iovec riov[3] = {
+		{in, 1}, {in + 1, 1300}, {in + 1301, 747}};
+	int i;
+
+	for (i = 0; i < (int)sizeof(out); i++)
+		out[i] = (char)(i * 13);
+	memset(in, 0, sizeof(in));
+
+	return set_test_type(TEST_TYPE_LOOP) &&
+		usb_bulk_writev(g_dev, EP_OUT, wiov, 4, 1000) == (int)sizeof(out) &&
+		usb_bulk_readv(g_dev, EP_IN, riov, 3, 1000) == (int)sizeof(in) &&
+		memcmp(in, out, sizeof(out)) == 0;
+}
+
+/* one result per packet of the last submit, at its offset in the buffer */
+static int check_iso_results(void)
+{
+	struct usb_iso_packet_result results[8];
+	char buffer[8 * 64];
+	void *context = NULL;
+	int i, passed = 0;
+
+	if (usb_isochronous_setup_async(g_dev, &context, EP_IN, 64) < 0 ||
+		usb_submit_async(context, buffer, sizeof(buffer)) < 0 ||
+		usb_reap_async(context, 1000) != (int)sizeof(buffer) ||
+		usb_isochronous_get_results(context, results, 8) != 8)
+		goto Done;
+
+	for (i = 0; i < 8; i++) {
+		if (results[i].offset != i * 64 || results[i].length != 64 || results[i].status)
+			goto Done;
+	}
+	passed = 1;
+
+Done:
+	usb_free_async(&context);
+	return passed;
+}
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+/* the queue fd polls readable while a completion waits and not after a
+ * reap emptied the queue */
+static int check_queue_fd(void)
+{
+	struct usb_async_completion completions[2];
+	struct pollfd pfd;
+	char buffer[CHUNK];
+	void *context = NULL;
+	void *queue = NULL;
+	int passed = 0;
+
+	if (!set_test_type(TEST_TYPE_READ) || usb_async_queue_create(&queue, 1) < 0 ||
+		(pfd.fd = usb_async_queue_get_fd(queue)) < 0)
+		goto Done;
+	pfd.events = POLLIN;
+
+	/* a new fd is readable in case completions were already waiting */
+	if (usb_reap_async_many(queue, completions, 2, 0) != -ETIMEDOUT ||
+		poll(&pfd, 1, 0) != 0 ||
+		usb_bulk_setup_async(g_dev, &context, EP_IN) < 0 ||
+		usb_async_queue_attach(context, queue) < 0 ||
+		usb_submit_async(context, buffer, CHUNK) < 0)
+		goto Done;
+
+	passed = poll(&pfd, 1, 1000) == 1 &&
+		usb_reap_async_many(queue, completions, 2, 0) == 1 &&
+		completions[0].result == CHUNK &&
+		poll(&pfd, 1, 0) == 0;
+
+Done:
+	usb_free_async(&context);
+	usb_async_queue_free(&queue);
+	return passed;
+}
+#endif
+
+/* a batch goes out as far as it can; an entry whose context is already
+ * in flight fails on its own */
+static int check_submit_many(void)
+{
+	struct usb_async_submission subs[3];
+	char buffer[2][CHUNK];
+	void *contexts[2] = {NULL, NULL};
+	int i, passed = 0;
+
+	if (!set_test_type(TEST_TYPE_READ))
+		return 0;
+	for (i = 0; i < 2; i++) {
+		if (usb_bulk_setup_async(g_dev, &contexts[i], EP_IN) < 0)
+			goto Done;
+	}
+	for (i = 0; i < 3; i++) {
+		subs[i].context = contexts[i & 1];
+		subs[i].bytes = buffer[i & 1];
+		subs[i].size = CHUNK;
+	}
+
+	passed = usb_submit_async_many(subs, 3) == 2 &&
+		subs[0].result == 0 && subs[1].result == 0 && subs[2].result == -EINVAL &&
+		usb_reap_async(contexts[0], 1000) == CHUNK &&
+		usb_reap_async(contexts[1], 1000) == CHUNK;
+
+Done:
+	for (i = 0; i < 2; i++)
+		usb_free_async(&contexts[i]);
+	return passed;
+}
+
+/* SET_TEST and then GET_TEST as async control transfers; the data stage
+ * follows the setup packet in the buffer */
+static int check_control_async(void)
+{
+	char buffer[USB_CONTROL_SETUP_SIZE + 1];
+	void *context = NULL;
+	int passed = 0;
+
+	if (usb_control_setup_async(g_dev, &context) < 0)
+		return 0;
+
+	usb_control_fill_setup(buffer, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN,
+		SET_TEST, TEST_TYPE_LOOP, 0, 1);
+	if (usb_submit_async(context, buffer, sizeof(buffer)) < 0 ||
+		usb_reap_async(context, 1000) != 1)
+		goto Done;
+
+	usb_control_fill_setup(buffer, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN,
+		GET_TEST, 0, 0, 1);
+	buffer[USB_CONTROL_SETUP_SIZE] = 0;
+	passed = usb_submit_async(context, buffer, sizeof(buffer)) == 0 &&
+		usb_reap_async(context, 1000) == 1 &&
+		buffer[USB_CONTROL_SETUP_SIZE] == TEST_TYPE_LOOP;
+
+Done:
+	usb_free_async(&context);
+	return passed;
+}
+
+/* loop mode with nothing written: the read ends with -ETIMEDOUT at its
+ * own deadline, well before the reap would give up */
+static int check_submit_timeout(void)
+{
+	char buffer[CHUNK];
+	void *context = NULL;
+	muint64_t start;
+	int passed = 0;
+
+	if (!set_test_type(TEST_TYPE_LOOP) ||
+		usb_bulk_setup_async(g_dev, &context, EP_IN) < 0)
+		return 0;
+
+	start = Mpl_Clock_Ticks_Ms();
+	passed = usb_submit_async_timeout(context, buffer, CHUNK, 50) == 0 &&
+		usb_reap_async(context, 1000) == -ETIMEDOUT &&
+		Mpl_Clock_Ticks_Ms() - start < 500;
+
+	usb_free_async(&context);
+	return passed;
+}
+
+/* a poller reads reports until closed; one on an endpoint the device
+ * lacks fails to open and leaves nothing behind */
+static int check_poller(void)
+{
+	struct usb_interrupt_poll_params params;
+	struct usb_interrupt_poll_stats stats;
+	char report[64];
+	void *poll = NULL;
+	int i, passed = 0;
+
+	memset(&params, 0, sizeof(params));
+	params.report_size = sizeof(report);
+	params.depth = 4;
+	params.ring_reports = 16;
+
+	if (!set_test_type(TEST_TYPE_READ) ||
+		usb_interrupt_poll_open(g_dev, &poll, EP_IN + 1, &params) >= 0 || poll)
+		return 0;
+
+	if (usb_interrupt_poll_open(g_dev, &poll, EP_IN, &params) < 0)
+		return 0;
+	for (i = 0; i < 10; i++) {
+		if (usb_interrupt_poll_read(poll, report, sizeof(report), NULL, 1000) != (int)sizeof(report))
+			goto Done;
+	}
+	passed = usb_interrupt_poll_get_stats(poll, &stats, 0) == 0 &&
+		stats.reports >= 10 && !stats.errors;
+
+Done:
+	usb_interrupt_poll_close(&poll);
+	return passed;
+}
+
+/* buffers left on a handle are freed by usb_close(); a stream opened on
+ * it can still be closed afterwards */
+static int check_buffers_after_close(void)
+{
+	usb_dev_handle *other;
+	void *stream = NULL;
+	char *buffer;
+
+	if (!set_test_type(TEST_TYPE_READ) ||
+		(other = usb_open(usb_device(g_dev))) == NULL)
+		return 0;
+
+	if ((buffer = usb_alloc_buffer(other, 4 * CHUNK)) == NULL ||
+		usb_bulk_read(other, EP_IN, buffer, 4 * CHUNK, 1000) != 4 * CHUNK ||
+		usb_stream_open(other, &stream, EP_IN, 2, CHUNK) < 0) {
+		usb_close(other);
+		return 0;
+	}
+
+	usb_close(other);
+	return usb_stream_close(&stream) == 0;
+}
+
+/* loop mode: sync transfers on two handles of the device, each with its
+ * own cached transfer, and on one of them after the other was closed */
+static int check_sync_handles(void)
+{
+	char out[CHUNK], in[CHUNK];
+	usb_dev_handle *other;
+	int i, passed = 0;
+
+	if (!set_test_type(TEST_TYPE_LOOP) ||
+		(other = usb_open(usb_device(g_dev))) == NULL)
+		return 0;
+
+	for (i = 0; i < 4; i++) {
+		usb_dev_handle *writer = (i & 1) ? other : g_dev;
+		usb_dev_handle *reader = (i & 1) ? g_dev : other;
+
+		memset(out, i + 1, sizeof(out));
+		if (usb_bulk_write(writer, EP_OUT, out, CHUNK, 1000) != CHUNK ||
+			usb_bulk_read(reader, EP_IN, in, CHUNK, 1000) != CHUNK ||
+			memcmp(in, out, CHUNK) != 0)
+			goto Done;
+	}
+	usb_close(other);
+	other = NULL;
+
+	passed = usb_bulk_write(g_dev, EP_OUT, out, CHUNK, 1000) == CHUNK &&
+		usb_bulk_read(g_dev, EP_IN, in, CHUNK, 1000) == CHUNK;
+
+Done:
+	if (other)
+		usb_close(other);
+	return passed;
+}
+
+static int run_check(const char *name, int (*check)(void))
+{
+	int passed;
+
+	CONMSG("%-28s", name);
+	passed = check();
+	CONMSG(passed ? " Passed!\n" : " Failed!\n");
+	return passed;
+}
+
+/* opens the simulated device as g_dev */
+static int open_sim(int sync_through_async)
+{
+	struct usb_init_params initParams;
+	struct usb_device *dev;
+	int ret;
+
+	memset(&initParams, 0, sizeof(initParams));
+	initParams.size = sizeof(initParams);
+	initParams.backend = USB_BACKEND_SIMULATED;
+	initParams.sync_through_async = sync_through_async;
+	if ((ret = usb_initex(&initParams)) < 0) {
+		CONERR("failed initializing simulated device. ret=%d\n", ret);
+		return 0;
+	}
+	usb_find_busses();
+	usb_find_devices();
+
+	if (!usb_get_busses() || (dev = usb_get_busses()->devices) == NULL ||
+		(g_dev = usb_open(dev)) == NULL) {
+		CONERR("simulated device not found.\n");
+		usb_exit();
+		return 0;
+	}
+	return 1;
+}
+
+static void close_sim(void)
+{
+	usb_close(g_dev);
+	g_dev = NULL;
+	usb_exit();
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+
+	Mpl_Init();
+	if (!open_sim(0))
+		return -1;
+
+	failed += !run_check("Submit and reap:", check_submit_reap);
+	failed += !run_check("Completion queue:", check_queue);
+	failed += !run_check("Cancel:", check_cancel);
+	failed += !run_check("Context pool:", check_pool);
+	failed += !run_check("Bulk streams:", check_stream);
+	failed += !run_check("Callback resubmit:", check_callback_resubmit);
+	failed += !run_check("Queue batches:", check_queue_batches);
+	failed += !run_check("Vectored I/O:", check_vectored);
+	failed += !run_check("Iso packet results:", check_iso_results);
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+	failed += !run_check("Queue fd:", check_queue_fd);
+#endif
+	failed += !run_check("Batch submit:", check_submit_many);
+	failed += !run_check("Async control:", check_control_async);
+	failed += !run_check("Submit timeout:", check_submit_timeout);
+	failed += !run_check("Interrupt poller:", check_poller);
+	failed += !run_check("Buffers after close:", check_buffers_after_close);
+	close_sim();
+
+	/* sync transfers completed on the event threads */
+	if (!open_sim(1))
+		return -1;
+	failed += !run_check("Sync through async:", check_sync_handles);
+	close_sim();
+
+	Mpl_Free();
+	return failed;
+}
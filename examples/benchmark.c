@@ -149,6 +149,9 @@ struct BM_TEST_PARAM
     int Priority;		// Priority to run this thread at.
 	int Verify;		// Only for loop and read test. If true, verifies data integrity. 
 	int VerifyDetails;	// If true, prints detailed information for each invalid byte.
+	int UseSim;			// If true, run against the simulated device backend.
+	int SimLatency;		// Simulated transfer latency (us)
+	int SimBytesPerSec;	// Simulated bus speed (bytes/sec, 0=unlimited)
     enum BM_DEVICE_TEST_TYPE TestType;	// The benchmark test type.
 	enum BM_TRANSFER_MODE TransferMode;	// Sync or Async
 
@@ -723,27 +726,20 @@ MPL_THDPROC_RETURN_TYPE MPL_THDPROC_CC TransferThreadProc(void* user_context)
 
 Done:
 
+	// cancel everything still in flight on the endpoint and wait once
+	if ((r = usb_cancel_endpoint(transferParam->Test->DeviceHandle, transferParam->Ep.bEndpointAddress)) < 0)
+	{
+		if (!transferParam->Test->IsUserAborted)
+		{
+			XFERLOG(ERR, transferParam, "Cancel endpoint failed. ret=%d\n",r);
+		}
+	}
+
 	for (i=0; i < transferParam->Test->BufferCount; i++)
 	{
 		if (transferParam->TransferHandles[i].Context)
 		{
-			if (transferParam->TransferHandles[i].InUse)
-			{
-				int r_cancel;
-				if ((r_cancel = usb_cancel_async(transferParam->TransferHandles[i].Context)) < 0)
-				{
-					if (!transferParam->Test->IsUserAborted)
-					{
-						XFERLOG(ERR, transferParam, "Cancel transfer failed. ret=%d\n",r_cancel);
-					}
-				}
-				else
-				{
-					usb_reap_async_nocancel(transferParam->TransferHandles[i].Context, INFINITE);
-				}
-
-				transferParam->TransferHandles[i].InUse=FALSE;
-			}
+			transferParam->TransferHandles[i].InUse=FALSE;
 			usb_free_async(&transferParam->TransferHandles[i].Context);
 		}
 	}
@@ -818,6 +814,8 @@ int ParseBenchmarkArgs(struct BM_TEST_PARAM* testParams, int argc, char **argv)
 		}
         else if (GetParamIntValue(arg, "refresh=", &testParams->Refresh)) {}
         else if (GetParamIntValue(arg, "isopacketsize=", &testParams->IsoPacketSize)) {}
+        else if (GetParamIntValue(arg, "simlatency=", &testParams->SimLatency)) {}
+        else if (GetParamIntValue(arg, "simbps=", &testParams->SimBytesPerSec)) {}
         else if ((value=GetParamStrValue(arg,"mode="))!=NULL)
         {
             if (GetParamStrValue(value,"sync"))
@@ -888,6 +886,10 @@ int ParseBenchmarkArgs(struct BM_TEST_PARAM* testParams, int argc, char **argv)
         {
             testParams->UseList = TRUE;
         }
+        else if (!strcmp(arg,"sim"))
+        {
+            testParams->UseSim = TRUE;
+        }
         else if (!strcmp(arg,"verifydetails"))
         {
             testParams->VerifyDetails = TRUE;
@@ -1414,7 +1416,27 @@ int BM_MAIN_CALL main(int argc, char** argv)
 	usb_set_debug(3);
 
     // Initialize the library.
-    usb_initex(NULL);
+	if (Test.UseSim)
+	{
+		struct usb_init_params initParams;
+
+		memset(&initParams,0,sizeof(initParams));
+		initParams.size = sizeof(initParams);
+		initParams.backend = USB_BACKEND_SIMULATED;
+		initParams.sim.idVendor = (uint16_t)Test.Vid;
+		initParams.sim.idProduct = (uint16_t)Test.Pid;
+		initParams.sim.latency_us = Test.SimLatency;
+		initParams.sim.bytes_per_sec = Test.SimBytesPerSec;
+		if ((ret = usb_initex(&initParams)) < 0)
+		{
+			CONERR("failed initializing simulated device. ret=%d\n",ret);
+			return -1;
+		}
+	}
+	else
+	{
+		usb_initex(NULL);
+	}
 
     // Find all busses.
     usb_find_busses();
@@ -1734,6 +1756,7 @@ void ShowHelp(void)
 	printf("                 [verify|verifydetail]\n");
 	printf("                 [retry=] [timeout=] [refresh=] [priority=]\n");
 	printf("                 [mode=] [buffersize=] [buffercount=] [packetsize=]\n");
+	printf("                 [sim] [simlatency=] [simbps=]\n");
 	printf("                 \n");
 	printf("Commands:\n");
 	printf("         list  : Display a list of connected devices before starting. \n");
@@ -1782,6 +1805,10 @@ void ShowHelp(void)
 	printf("         packetsize : For isochronous use only. Sets the iso packet size.\n");
 	printf("                      If not specified, the endpoints maximum packet size\n");
 	printf("                      is used.         \n");
+	printf("         sim        : Run against a simulated benchmark device instead of\n");
+	printf("                      real hardware. Uses the vid/pid given above.\n");
+	printf("         simlatency : Simulated transfer latency. (microseconds) (Default=0)\n");
+	printf("         simbps     : Simulated bus speed. (bytes/sec) (Default=0, unlimited)\n");
 	printf("WARNING:\n");
 	printf("          This program should only be used with USB devices which implement\n");
 	printf("          one more more \"Benchmark\" interface(s).  Using this application\n");
@@ -28,6 +28,10 @@
 #include <string.h>
 #if !defined(_WIN32) && !defined(__CYGWIN__)
 #include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
 #endif
 #include <libusb.h>
 
@@ -43,48 +47,209 @@
 #endif
 
 #define ASYNC_TIMVAL_SEC	(1)
+#define ASYNC_DRAIN_POLL_MS	(10)
+
+/* state written on every transfer is kept on cache lines of its own */
+#define ASYNC_CACHE_LINE	(64)
+#define ASYNC_CACHE_PAD(name)	char name[ASYNC_CACHE_LINE]
+
+/* in-flight counts are spread over shards picked per thread */
+#define ASYNC_FLY_SHARDS	(16)
+
+#if defined(_MSC_VER)
+#define ASYNC_THREAD_LOCAL __declspec(thread)
+#else
+#define ASYNC_THREAD_LOCAL __thread
+#endif
 #define ALLOW_HANDLE_EVENTS_THREAD_IDLE
 
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#define HAVE_LIBUSB_HOTPLUG
+#endif
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_DEV_MEM
+#endif
+
+/* alignment of transfer buffers that come from the heap */
+#define BUFFER_ALIGN	(4096)
+
 #if defined(_MSC_VER) && _MSC_VER >= 1310
 // VS 2003 or greater.
 #  pragma warning(disable:4100)	// unreferenced formal parameter
 #  pragma warning(disable:4127)	// conditional expression is constant
 #endif
 
+typedef struct usb_async_queue usb_async_queue_t;
+typedef struct usb_async_pool usb_async_pool_t;
+
 /* libusb0 async transfer context */
-typedef struct
+typedef struct usb_async_transfer
 {
     usb_dev_handle *dev;
     struct libusb_transfer *transfer;
-	MPL_EVENT_T complete_event;
-	volatile long ref_count;
 	int legacy_iso_pktsize;
 
+	/* pack the payloads of isochronous packets at the buffer start */
+	int iso_compact;
+
+	/* number of iso packet descriptors allocated with the transfer */
+	int max_iso_packets;
+
+	/* completion queue this context reports to, or NULL */
+	usb_async_queue_t *queue;
+
+	/* completion callback, see usb_async_set_callback() */
+	usb_async_callback callback;
+	void *callback_data;
+	int resubmit;
+	/* the in-flight tracking of the handle and the links of its context
+	 * list, see usb_cancel_endpoint() */
+	struct usbi_inflight *inflight;
+	struct usb_async_transfer *inflight_next;
+	struct usb_async_transfer *inflight_prev;
+
+	/* pool this context was taken from, or NULL if it was malloc'd */
+	usb_async_pool_t *pool;
+	struct usb_async_transfer *next_free;
+
+	/* endpoint statistics of the handle */
+	struct usbi_stats *stats;
+
+	/* written by the submitting, completing and reaping threads; kept off
+	 * the lines of the fields above and of the next pooled context */
+	ASYNC_CACHE_PAD(pad0);
+	volatile long ref_count;
+	MPL_EVENT_T complete_event;
+	/* set by usb_cancel_async(); ends auto-resubmit */
+	volatile int cancelled;
+	/* set from submit until the completion callback runs */
+	volatile int submitted;
+	/* when the current transfer was submitted and completed */
+	muint64_t submit_us;
+	muint64_t complete_us;
+	ASYNC_CACHE_PAD(pad1);
+
 } usb_async_transfer_t;
 
+/* libusb0 per-handle async context pool.
+ * The contexts, their libusb transfers and events are set up once by
+ * usb_setup_async_pool(); usb_*_setup_async() and usb_free_async() then
+ * only move contexts on and off the free list.
+ */
+struct usb_async_pool
+{
+	MPL_MUTEX_T lock;
+	usb_async_transfer_t *contexts;
+	usb_async_transfer_t *free_list;
+	int count;
+	int max_iso_packets;
+
+	/* contexts handed out; the pool outlives its handle until they return */
+	int outstanding;
+	int closed;
+};
+
+/* libusb0 async completion queue.
+ * A multi-producer, single-consumer ring of completed transfer contexts.
+ * Callbacks reserve a slot by incrementing head and publish the context
+ * into it; the reaper consumes slots in order from tail. The ring holds
+ * at least as many slots as there are attached contexts, and a context
+ * cannot be resubmitted until it has been reaped, so it never overflows.
+ */
+struct usb_async_queue
+{
+	usb_async_transfer_t* volatile *slots;
+	long mask;
+	volatile long head;
+	long tail;
+
+	/* number of attached contexts; limited to mask + 1 */
+	volatile long attached;
+
+	/* set by the reaper before it sleeps on event */
+	volatile long waiting;
+	MPL_EVENT_T event;
+
+	/* pollable notification, see usb_async_queue_get_fd(). notify_fd[0]
+	 * is read, notify_fd[1] written; both are the same eventfd on linux.
+	 * notify_pending is set while the fd is readable. */
+	int notify_fd[2];
+	volatile long notify_pending;
+};
+
+/* one shard of the in-flight count; only the sum over all shards means
+ * anything, a single shard may well be negative */
+struct async_fly_shard
+{
+	volatile long count;
+	char pad[ASYNC_CACHE_LINE - sizeof(long)];
+};
+
 /* libusb0 async thread handler members */
 typedef struct
 {
 #ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
-	volatile long fly_count;
+	ASYNC_CACHE_PAD(pad0);
+	struct async_fly_shard fly[ASYNC_FLY_SHARDS];
+	volatile long fly_next_shard;
 #endif
 	volatile long is_run;
 
+	/* cpus to pin the event thread to */
+	muint64_t cpu_mask;
+
+	/* no event threads; events are handled by usb_handle_events() and by
+	 * the waiting calls themselves */
+	int external;
+
 	MPL_THREAD_T handle;
 	MPL_MUTEX_T init_mutex;
-	MPL_EVENT_T event_running;
 	MPL_EVENT_T event_terminated;
+
+	/* read on every submit, written only when the event thread goes idle */
+	ASYNC_CACHE_PAD(pad1);
+	volatile long idle;
+	MPL_EVENT_T event_running;
+	ASYNC_CACHE_PAD(pad2);
 } usb_async_thread_t;
 
+static const struct usbi_backend usbi_libusb10_backend;
+
 /* Globals: */
 static libusb_context *ctx = NULL;
 static int usb_debug = 0;
+static int stats_enabled = 0;
+static int drain_on_close = 0;
+static int sync_through_async = 0;
 static usb_async_thread_t async_thread;
+static const struct usbi_backend *backend = &usbi_libusb10_backend;
 
 struct usb_bus *usb_busses = NULL;
 
 static volatile long g_usb0_lib_init_lock = 0;
 
+#ifdef HAVE_LIBUSB_HOTPLUG
+/* a device arrival or departure reported by libusb */
+struct hotplug_change {
+	struct hotplug_change *next;
+	libusb_device *dev;
+	int arrived;
+};
+
+/* hotplug mode state; changes are queued in arrival order */
+static struct {
+	int registered;
+	libusb_hotplug_callback_handle handle;
+	MPL_MUTEX_T lock;
+	struct hotplug_change *head;
+	struct hotplug_change *tail;
+} hotplug;
+
+static int hotplug_find_busses(struct usb_bus **ret);
+static int hotplug_find_devices(void);
+#endif
+
 #define compat_err(e) -(errno=libusb_to_errno(e))
 static int libusb_to_errno(int result)
 {
@@ -143,40 +308,84 @@ API_EXPORTED void USBAPI_DECL usb_init(void)
 }
 
 static int async_start_events(void);
+static int sync_io_transfer(usb_dev_handle *dev, unsigned char type,
+	unsigned char ep, unsigned char *data, int length, int *actual_length,
+	unsigned int timeout);
+static int sync_io_control(usb_dev_handle *dev, uint8_t bmRequestType,
+	uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data,
+	uint16_t wLength, unsigned int timeout);
+static void sync_io_close(usb_dev_handle *dev);
+#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
+static int async_fly_pending(void);
+#endif
 
 API_EXPORTED int USBAPI_DECL usb_initex(void* reserved)
 {
+	struct usb_init_params params;
 	int r=0;
 	UD_DBG("\n");
 
+	memset(&params, 0, sizeof(params));
+	if (reserved) {
+		const struct usb_init_params *user_params = reserved;
+		if (user_params->size < (int)sizeof(int))
+			return -(errno=EINVAL);
+		memcpy(&params, user_params, user_params->size < (int)sizeof(params) ?
+			(size_t)user_params->size : sizeof(params));
+	}
+
 	if (MPL_Atomic_Inc32(&g_usb0_lib_init_lock) == 1) {
 
-		usb_init();
-		if (!ctx) {
+		switch (params.backend) {
+		case USB_BACKEND_LIBUSB10:
+			backend = &usbi_libusb10_backend;
+			break;
+		case USB_BACKEND_SIMULATED:
+			backend = &usbi_sim_backend;
+			break;
+		default:
 			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
-			UD_ERR("libusb_init failed. ret=%d\n",r);
-				return -errno;
+			UD_ERR("invalid backend %d\n", params.backend);
+			return -(errno=EINVAL);
 		}
 
+		/* backends may set up Mpl objects of their own */
 		if ((r = Mpl_Init()) != MPL_SUCCESS) {
-			libusb_exit(ctx); ctx = NULL;
+			backend = &usbi_libusb10_backend;
 			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
 			UD_ERR("Mpl_Init failed. ret=%d\n",r);
 			return -(errno=r);
 		}
 
+		if ((r = backend->init(&params)) != 0) {
+			Mpl_Free();
+			backend = &usbi_libusb10_backend;
+			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
+			UD_ERR("backend init failed. ret=%d\n",r);
+			return r;
+		}
+
+		/* initialize the async thread members */
+		memset(&async_thread,0,sizeof(async_thread));
+		async_thread.cpu_mask = params.event_cpu_mask;
+		async_thread.external = params.external_events;
+		stats_enabled = params.endpoint_stats;
+		drain_on_close = params.drain_on_close;
+		sync_through_async = params.sync_through_async;
+
 		if ((r = Mpl_Mutex_Init(&async_thread.init_mutex)) != MPL_SUCCESS) {
+			backend->exit();
 			Mpl_Free();
-			libusb_exit(ctx); ctx = NULL;
 			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
 			UD_ERR("Mpl_Mutex_Init failed. ret=%d\n",r);
 			return -(errno=r);
 		}
 
-		if ((r = Mpl_Event_Init(&async_thread.event_running,1,0)) != MPL_SUCCESS) {
+		/* manual reset; the event thread resets it before going idle */
+		if ((r = Mpl_Event_Init(&async_thread.event_running,0,0)) != MPL_SUCCESS) {
 			Mpl_Mutex_Free(&async_thread.init_mutex);
+			backend->exit();
 			Mpl_Free();
-			libusb_exit(ctx); ctx = NULL;
 			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
 			UD_ERR("Mpl_Event_Init failed. ret=%d",r);
 			return -(errno=r);
@@ -184,20 +393,20 @@ API_EXPORTED int USBAPI_DECL usb_initex(void* reserved)
 		if ((r = Mpl_Event_Init(&async_thread.event_terminated,0,0)) != MPL_SUCCESS) {
 			Mpl_Event_Free(&async_thread.event_running);
 			Mpl_Mutex_Free(&async_thread.init_mutex);
+			backend->exit();
 			Mpl_Free();
-			libusb_exit(ctx); ctx = NULL;
 			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
 			UD_ERR("Mpl_Mutex_Init failed. ret=%d\n",r);
 			return -(errno=r);
 		}
 
-		if ((r = async_start_events()) != 0)
+		if (!async_thread.external && (r = async_start_events()) != 0)
 		{
 			Mpl_Event_Free(&async_thread.event_terminated);
 			Mpl_Event_Free(&async_thread.event_running);
 			Mpl_Mutex_Free(&async_thread.init_mutex);
+			backend->exit();
 			Mpl_Free();
-			libusb_exit(ctx); ctx = NULL;
 			MPL_Atomic_Dec32(&g_usb0_lib_init_lock);
 			UD_ERR("async_start_events failed. ret=%d\n",r);
 			return -(errno=r);
@@ -222,6 +431,125 @@ API_EXPORTED char* USBAPI_DECL usb_strerror(void)
 	return strerror(errno);
 }
 
+///////////////////////////////////////
+/* device index                      */
+///////////////////////////////////////
+
+/* Every device in usb_busses is also hashed by bus/devnum and by
+ * vendor/product id. Whoever links a device into bus->devices or unlinks
+ * it adds or removes it here as well. */
+#define DEVICE_HASH_SIZE	256
+
+struct device_node {
+	struct device_node *next_addr;
+	struct device_node *next_id;
+	struct usb_device *dev;
+	unsigned int scan;
+};
+
+static struct device_node *device_addr_hash[DEVICE_HASH_SIZE];
+static struct device_node *device_id_hash[DEVICE_HASH_SIZE];
+
+#define DEVICE_ADDR_HASH(bus_num, devnum) \
+	((((bus_num) * 31) + (devnum)) & (DEVICE_HASH_SIZE - 1))
+#define DEVICE_ID_HASH(vid, pid) \
+	((((vid) * 31) ^ (pid)) & (DEVICE_HASH_SIZE - 1))
+
+static struct device_node *device_index_find_node(unsigned int bus_num,
+	unsigned int devnum)
+{
+	struct device_node *node;
+
+	node = device_addr_hash[DEVICE_ADDR_HASH(bus_num, devnum)];
+	for (; node; node = node->next_addr) {
+		if (node->dev->bus->location == bus_num && node->dev->devnum == devnum)
+			return node;
+	}
+	return NULL;
+}
+
+int usbi_device_index_add(struct usb_device *dev)
+{
+	struct device_node *node;
+	struct device_node **tail;
+
+	node = malloc(sizeof(*node));
+	if (!node)
+		return -ENOMEM;
+	node->next_addr = NULL;
+	node->next_id = NULL;
+	node->dev = dev;
+	node->scan = 0;
+
+	node->next_addr = device_addr_hash[DEVICE_ADDR_HASH(dev->bus->location, dev->devnum)];
+	device_addr_hash[DEVICE_ADDR_HASH(dev->bus->location, dev->devnum)] = node;
+
+	/* append, so usb_find_device_by_id() indexes follow arrival order */
+	tail = &device_id_hash[DEVICE_ID_HASH(dev->descriptor.idVendor, dev->descriptor.idProduct)];
+	while (*tail)
+		tail = &(*tail)->next_id;
+	*tail = node;
+
+	return 0;
+}
+
+void usbi_device_index_remove(struct usb_device *dev)
+{
+	struct device_node **link;
+	struct device_node *node = NULL;
+
+	link = &device_addr_hash[DEVICE_ADDR_HASH(dev->bus->location, dev->devnum)];
+	for (; *link; link = &(*link)->next_addr) {
+		if ((*link)->dev == dev) {
+			node = *link;
+			*link = node->next_addr;
+			break;
+		}
+	}
+	if (!node)
+		return;
+
+	link = &device_id_hash[DEVICE_ID_HASH(dev->descriptor.idVendor, dev->descriptor.idProduct)];
+	for (; *link; link = &(*link)->next_id) {
+		if (*link == node) {
+			*link = node->next_id;
+			break;
+		}
+	}
+	free(node);
+}
+
+struct usb_device *usbi_device_index_find(unsigned int bus_num, unsigned int devnum)
+{
+	struct device_node *node = device_index_find_node(bus_num, devnum);
+	return node ? node->dev : NULL;
+}
+
+API_EXPORTED struct usb_device* USBAPI_DECL usb_find_device_by_addr(int bus_num, int devnum)
+{
+	struct usb_device *dev = usbi_device_index_find(bus_num, devnum);
+
+	if (!dev)
+		errno = ENOENT;
+	return dev;
+}
+
+API_EXPORTED struct usb_device* USBAPI_DECL usb_find_device_by_id(int vid, int pid, int index)
+{
+	struct device_node *node;
+
+	node = device_id_hash[DEVICE_ID_HASH(vid & 0xffff, pid & 0xffff)];
+	for (; node; node = node->next_id) {
+		if (node->dev->descriptor.idVendor == (vid & 0xffff) &&
+			node->dev->descriptor.idProduct == (pid & 0xffff) &&
+			index-- == 0)
+			return node->dev;
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
 static int find_busses(struct usb_bus **ret)
 {
 	libusb_device **dev_list = NULL;
@@ -231,6 +559,16 @@ static int find_busses(struct usb_bus **ret)
 	int i;
 	int r;
 
+	/* libusb-1.0 initialization might have failed, but we can't indicate
+	 * this with libusb-0.1, so trap that situation here */
+	if (!ctx)
+		return 0;
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+	if (hotplug.registered)
+		return hotplug_find_busses(ret);
+#endif
+
 	r = libusb_get_device_list(ctx, &dev_list);
 	if (r < 0) {
 		UD_ERR("get_device_list failed with error %d\n", r);
@@ -298,13 +636,8 @@ API_EXPORTED int USBAPI_DECL usb_find_busses(void)
 	int changes = 0;
 	int r;
 
-	/* libusb-1.0 initialization might have failed, but we can't indicate
-	 * this with libusb-0.1, so trap that situation here */
-	if (!ctx)
-		return 0;
-	
 	UD_DBG("\n");
-	r = find_busses(&new_busses);
+	r = backend->find_busses(&new_busses);
 	if (r < 0) {
 		UD_ERR("find_busses failed with error %d\n", r);
 		return r;
@@ -334,8 +667,12 @@ API_EXPORTED int USBAPI_DECL usb_find_busses(void)
 		}
 
 		if (!found) {
+			struct usb_device *dev;
+
 			/* bus removed */
 			UD_DBG("bus %d removed\n", bus->location);
+			for (dev = bus->devices; dev; dev = dev->next)
+				usbi_device_index_remove(dev);
 			changes++;
 			LIST_DEL(usb_busses, bus);
 			free(bus);
@@ -358,210 +695,139 @@ API_EXPORTED int USBAPI_DECL usb_find_busses(void)
 	return changes;
 }
 
-static int find_devices(libusb_device **dev_list, int dev_list_len,
-	struct usb_bus *bus, struct usb_device **ret)
-{
-	struct usb_device *devices = NULL;
-	struct usb_device *dev;
-	int i;
+/* The descriptor tree of a device lives in one allocation. The arrays of
+ * descriptor structures come first, starting with the config array that
+ * dev->config points to; the "extra" blobs are packed behind them. */
+struct descriptor_arena {
+	unsigned char *next;
+	unsigned char *extra;
+};
 
-	for (i = 0; i < dev_list_len; i++) {
-		libusb_device *newlib_dev = dev_list[i];
-		uint8_t bus_num = libusb_get_bus_number(newlib_dev);
+#define ARENA_ALIGN(size) \
+	(((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
 
-		if (bus_num != bus->location)
-			continue;
+static void *arena_alloc(struct descriptor_arena *arena, size_t size)
+{
+	void *ptr = arena->next;
+	arena->next += ARENA_ALIGN(size);
+	return ptr;
+}
 
-		dev = malloc(sizeof(*dev));
-		if (!dev)
-			goto err;
+static unsigned char *arena_copy_extra(struct descriptor_arena *arena,
+	const unsigned char *src, int length)
+{
+	unsigned char *ptr;
 
-		/* No need to reference the device now, just take the pointer. We
-		 * increase the reference count later if we keep the device. */
-		dev->dev = newlib_dev;
+	if (!length)
+		return NULL;
+	ptr = arena->extra;
+	memcpy(ptr, src, length);
+	arena->extra += length;
+	return ptr;
+}
 
-		dev->bus = bus;
-		dev->devnum = libusb_get_device_address(newlib_dev);
-		sprintf(dev->filename, "%03d", dev->devnum);
-		LIST_ADD(devices, dev);
-	}
+/* sizes the arena for one configuration; the struct arrays are returned
+ * and the extra blob lengths are added to *extra_size */
+static size_t config_arena_size(const struct libusb_config_descriptor *src,
+	size_t *extra_size)
+{
+	size_t size;
+	int i, j, k;
 
-	*ret = devices;
-	return 0;
+	size = ARENA_ALIGN(sizeof(struct usb_interface) * src->bNumInterfaces);
+	*extra_size += src->extra_length;
 
-err:
-	dev = devices;
-	while (dev) {
-		struct usb_device *tdev = dev->next;
-		free(dev);
-		dev = tdev;
-	}
-	return -ENOMEM;
-}
+	for (i = 0; i < src->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &src->interface[i];
 
-static void clear_endpoint_descriptor(struct usb_endpoint_descriptor *ep)
-{
-	if (ep->extra)
-		free(ep->extra);
-}
+		size += ARENA_ALIGN(sizeof(struct usb_interface_descriptor) *
+			iface->num_altsetting);
 
-static void clear_interface_descriptor(struct usb_interface_descriptor *iface)
-{
-	if (iface->extra)
-		free(iface->extra);
-	if (iface->endpoint) {
-		int i;
-		for (i = 0; i < iface->bNumEndpoints; i++)
-			clear_endpoint_descriptor(iface->endpoint + i);
-		free(iface->endpoint);
-	}
-}
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *altsetting =
+				&iface->altsetting[j];
 
-static void clear_interface(struct usb_interface *iface)
-{
-	if (iface->altsetting) {
-		int i;
-		for (i = 0; i < iface->num_altsetting; i++)
-			clear_interface_descriptor(iface->altsetting + i);
-		free(iface->altsetting);
-	}
-}
+			size += ARENA_ALIGN(sizeof(struct usb_endpoint_descriptor) *
+				altsetting->bNumEndpoints);
+			*extra_size += altsetting->extra_length;
 
-static void clear_config_descriptor(struct usb_config_descriptor *config)
-{
-	if (config->extra)
-		free(config->extra);
-	if (config->interface) {
-		int i;
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface(config->interface + i);
-		free(config->interface);
+			for (k = 0; k < altsetting->bNumEndpoints; k++)
+				*extra_size += altsetting->endpoint[k].extra_length;
+		}
 	}
-}
 
-static void clear_device(struct usb_device *dev)
-{
-	int i;
-	for (i = 0; i < dev->descriptor.bNumConfigurations; i++)
-		clear_config_descriptor(dev->config + i);
+	return size;
 }
 
-static int copy_endpoint_descriptor(struct usb_endpoint_descriptor *dest,
+static void copy_endpoint_descriptor(struct descriptor_arena *arena,
+	struct usb_endpoint_descriptor *dest,
 	const struct libusb_endpoint_descriptor *src)
 {
 	memcpy(dest, src, USB_DT_ENDPOINT_AUDIO_SIZE);
 
 	dest->extralen = src->extra_length;
-	if (src->extra_length) {
-		dest->extra = malloc(src->extra_length);
-		if (!dest->extra)
-			return -ENOMEM;
-		memcpy(dest->extra, src->extra, src->extra_length);
-	}
-
-	return 0;
+	dest->extra = arena_copy_extra(arena, src->extra, src->extra_length);
 }
 
-static int copy_interface_descriptor(struct usb_interface_descriptor *dest,
+static void copy_interface_descriptor(struct descriptor_arena *arena,
+	struct usb_interface_descriptor *dest,
 	const struct libusb_interface_descriptor *src)
 {
 	int i;
 	int num_endpoints = src->bNumEndpoints;
-	size_t alloc_size = sizeof(struct usb_endpoint_descriptor) * num_endpoints;
 
 	memcpy(dest, src, USB_DT_INTERFACE_SIZE);
-	dest->endpoint = malloc(alloc_size);
-	if (!dest->endpoint)
-		return -ENOMEM;
-	memset(dest->endpoint, 0, alloc_size);
+	dest->endpoint = arena_alloc(arena,
+		sizeof(struct usb_endpoint_descriptor) * num_endpoints);
 
-	for (i = 0; i < num_endpoints; i++) {
-		int r = copy_endpoint_descriptor(dest->endpoint + i, &src->endpoint[i]);
-		if (r < 0) {
-			clear_interface_descriptor(dest);
-			return r;
-		}
-	}
+	for (i = 0; i < num_endpoints; i++)
+		copy_endpoint_descriptor(arena, dest->endpoint + i, &src->endpoint[i]);
 
 	dest->extralen = src->extra_length;
-	if (src->extra_length) {
-		dest->extra = malloc(src->extra_length);
-		if (!dest->extra) {
-			clear_interface_descriptor(dest);
-			return -ENOMEM;
-		}
-		memcpy(dest->extra, src->extra, src->extra_length);
-	}
-
-	return 0;
+	dest->extra = arena_copy_extra(arena, src->extra, src->extra_length);
 }
 
-static int copy_interface(struct usb_interface *dest,
-	const struct libusb_interface *src)
+static void copy_interface(struct descriptor_arena *arena,
+	struct usb_interface *dest, const struct libusb_interface *src)
 {
 	int i;
 	int num_altsetting = src->num_altsetting;
-	size_t alloc_size = sizeof(struct usb_interface_descriptor)
-		* num_altsetting;
 
 	dest->num_altsetting = num_altsetting;
-	dest->altsetting = malloc(alloc_size);
-	if (!dest->altsetting)
-		return -ENOMEM;
-	memset(dest->altsetting, 0, alloc_size);
+	dest->altsetting = arena_alloc(arena,
+		sizeof(struct usb_interface_descriptor) * num_altsetting);
 
-	for (i = 0; i < num_altsetting; i++) {
-		int r = copy_interface_descriptor(dest->altsetting + i,
+	for (i = 0; i < num_altsetting; i++)
+		copy_interface_descriptor(arena, dest->altsetting + i,
 			&src->altsetting[i]);
-		if (r < 0) {
-			clear_interface(dest);
-			return r;
-		}
-	}
-
-	return 0;
 }
 
-static int copy_config_descriptor(struct usb_config_descriptor *dest,
+static void copy_config_descriptor(struct descriptor_arena *arena,
+	struct usb_config_descriptor *dest,
 	const struct libusb_config_descriptor *src)
 {
 	int i;
 	int num_interfaces = src->bNumInterfaces;
-	size_t alloc_size = sizeof(struct usb_interface) * num_interfaces;
 
 	memcpy(dest, src, USB_DT_CONFIG_SIZE);
-	dest->interface = malloc(alloc_size);
-	if (!dest->interface)
-		return -ENOMEM;
-	memset(dest->interface, 0, alloc_size);
+	dest->interface = arena_alloc(arena,
+		sizeof(struct usb_interface) * num_interfaces);
 
-	for (i = 0; i < num_interfaces; i++) {
-		int r = copy_interface(dest->interface + i, &src->interface[i]);
-		if (r < 0) {
-			clear_config_descriptor(dest);
-			return r;
-		}
-	}
+	for (i = 0; i < num_interfaces; i++)
+		copy_interface(arena, dest->interface + i, &src->interface[i]);
 
 	dest->extralen = src->extra_length;
-	if (src->extra_length) {
-		dest->extra = malloc(src->extra_length);
-		if (!dest->extra) {
-			clear_config_descriptor(dest);
-			return -ENOMEM;
-		}
-		memcpy(dest->extra, src->extra, src->extra_length);
-	}
-
-	return 0;
+	dest->extra = arena_copy_extra(arena, src->extra, src->extra_length);
 }
 
 static int initialize_device(struct usb_device *dev)
 {
 	libusb_device *newlib_dev = dev->dev;
+	struct libusb_config_descriptor *newlib_configs[256];
+	struct descriptor_arena arena;
 	int num_configurations;
-	size_t alloc_size;
-	int r;
+	size_t struct_size, extra_size = 0;
+	int r = 0;
 	int i;
 
 	/* device descriptor is identical in both libs */
@@ -572,34 +838,42 @@ static int initialize_device(struct usb_device *dev)
 		return compat_err(r);
 	}
 
-	num_configurations = dev->descriptor.bNumConfigurations;
-	alloc_size = sizeof(struct usb_config_descriptor) * num_configurations;
-	dev->config = malloc(alloc_size);
-	if (!dev->config)
-		return -ENOMEM;
-	memset(dev->config, 0, alloc_size);
-
 	/* even though structures are identical, we can't just use libusb-1.0's
 	 * config descriptors because we have to store all configurations in
 	 * a single flat memory area (libusb-1.0 provides separate allocations).
-	 * we hand-copy libusb-1.0's descriptors into our own structures. */
+	 * we size the whole tree first, then hand-copy libusb-1.0's
+	 * descriptors into one block. */
+	num_configurations = dev->descriptor.bNumConfigurations;
+	struct_size = ARENA_ALIGN(sizeof(struct usb_config_descriptor) * num_configurations);
+
 	for (i = 0; i < num_configurations; i++) {
-		struct libusb_config_descriptor *newlib_config;
-		r = libusb_get_config_descriptor(newlib_dev,(uint8_t)i, &newlib_config);
-		if (r < 0) {
-			clear_device(dev);
-			free(dev->config);
-			return compat_err(r);
-		}
-		r = copy_config_descriptor(dev->config + i, newlib_config);
-		libusb_free_config_descriptor(newlib_config);
-		if (r < 0) {
-			clear_device(dev);
-			free(dev->config);
-			return r;
-		}
+		r = libusb_get_config_descriptor(newlib_dev,(uint8_t)i, &newlib_configs[i]);
+		if (r < 0)
+			break;
+		struct_size += config_arena_size(newlib_configs[i], &extra_size);
+	}
+
+	if (r < 0) {
+		r = compat_err(r);
+	} else if (struct_size + extra_size == 0) {
+		dev->config = NULL;
+	} else if ((dev->config = malloc(struct_size + extra_size)) == NULL) {
+		r = -ENOMEM;
+	} else {
+		memset(dev->config, 0, struct_size);
+		arena.next = (unsigned char *)dev->config;
+		arena.extra = arena.next + struct_size;
+		arena_alloc(&arena, sizeof(struct usb_config_descriptor) * num_configurations);
+
+		for (i = 0; i < num_configurations; i++)
+			copy_config_descriptor(&arena, dev->config + i, newlib_configs[i]);
 	}
 
+	while (i-- > 0)
+		libusb_free_config_descriptor(newlib_configs[i]);
+	if (r < 0)
+		return r;
+
 	/* libusb doesn't implement this and it doesn't seem that important. If
 	 * someone asks for it, we can implement it in v1.1 or later. */
 	dev->num_children = 0;
@@ -611,16 +885,20 @@ static int initialize_device(struct usb_device *dev)
 
 static void free_device(struct usb_device *dev)
 {
-	clear_device(dev);
+	free(dev->config);
 	libusb_unref_device(dev->dev);
 	free(dev);
 }
 
-API_EXPORTED int USBAPI_DECL usb_find_devices(void)
+static int find_all_devices(void)
 {
+	static unsigned int scan;
 	struct usb_bus *bus;
+	struct usb_device *dev;
+	struct device_node *node;
 	libusb_device **dev_list;
 	int dev_list_len;
+	int i;
 	int r;
 	int changes = 0;
 
@@ -629,67 +907,83 @@ API_EXPORTED int USBAPI_DECL usb_find_devices(void)
 	if (!ctx)
 		return 0;
 
+#ifdef HAVE_LIBUSB_HOTPLUG
+	if (hotplug.registered)
+		return hotplug_find_devices();
+#endif
+
 	UD_DBG("\n");
 	dev_list_len = libusb_get_device_list(ctx, &dev_list);
 	if (dev_list_len < 0)
 		return compat_err(dev_list_len);
 
-	for (bus = usb_busses; bus; bus = bus->next) {
-		struct usb_device *new_devices = NULL;
-		struct usb_device *dev;
+	/* mark the devices we already know about; anything not found in the
+	 * index is a new device */
+	scan++;
+	for (i = 0; i < dev_list_len; i++) {
+		libusb_device *newlib_dev = dev_list[i];
+		uint8_t bus_num = libusb_get_bus_number(newlib_dev);
+		uint8_t devnum = libusb_get_device_address(newlib_dev);
 
-		r = find_devices(dev_list, dev_list_len, bus, &new_devices);
-		if (r < 0) {
-			libusb_free_device_list(dev_list, 1);
-			return r;
+		if ((node = device_index_find_node(bus_num, devnum)) != NULL) {
+			node->scan = scan;
+			continue;
 		}
 
-		/* walk through the devices we already know about, removing duplicates
-		 * from the new list. if we do not find it in the new list, the device
-		 * has been removed. */
-		dev = bus->devices;
-		while (dev) {
-			int found = 0;
-			struct usb_device *tdev = dev->next;
-			struct usb_device *ndev = new_devices;
+		for (bus = usb_busses; bus; bus = bus->next) {
+			if (bus->location == bus_num)
+				break;
+		}
+		if (!bus)
+			continue;
 
-			while (ndev) {
-				if (ndev->devnum == dev->devnum) {
-					LIST_DEL(new_devices, ndev);
-					free(ndev);
-					found = 1;
-					break;
-				}
-				ndev = ndev->next;
-			}
+		dev = malloc(sizeof(*dev));
+		if (!dev) {
+			libusb_free_device_list(dev_list, 1);
+			return -ENOMEM;
+		}
+		memset(dev, 0, sizeof(*dev));
 
-			if (!found) {
-				UD_DBG("device %d.%d removed\n",
-					dev->bus->location, dev->devnum);
-				LIST_DEL(bus->devices, dev);
-				free_device(dev);
-				changes++;
-			}
+		dev->dev = newlib_dev;
+		dev->bus = bus;
+		dev->devnum = devnum;
+		sprintf(dev->filename, "%03d", dev->devnum);
 
-			dev = tdev;
+		r = initialize_device(dev);
+		if (r < 0) {
+			UD_ERR("couldn't initialize device %d.%d (error %d)\n",
+				bus->location, dev->devnum, r);
+			free(dev);
+			continue;
+		}
+		if (usbi_device_index_add(dev) < 0) {
+			free_device(dev);
+			continue;
 		}
+		device_index_find_node(bus_num, devnum)->scan = scan;
 
-		/* anything left in new_devices is a new device */
-		dev = new_devices;
-		while (dev) {
-			struct usb_device *tdev = dev->next;
-			r = initialize_device(dev);	
-			if (r < 0) {
-				UD_ERR("couldn't initialize device %d.%d (error %d)\n",
-					dev->bus->location, dev->devnum, r);
-				dev = tdev;
+		UD_DBG("device %d.%d added\n", bus->location, dev->devnum);
+		LIST_ADD(bus->devices, dev);
+		changes++;
+	}
+
+	/* known devices that were not seen have been removed */
+	for (bus = usb_busses; bus; bus = bus->next) {
+		struct usb_device *tdev;
+
+		for (dev = bus->devices; dev; dev = tdev) {
+			tdev = dev->next;
+
+			node = device_index_find_node(bus->location, dev->devnum);
+			if (node && node->scan == scan)
 				continue;
-			}
-			UD_DBG("device %d.%d added\n", dev->bus->location, dev->devnum);
-			LIST_DEL(new_devices, dev);
-			LIST_ADD(bus->devices, dev);
+
+			UD_DBG("device %d.%d removed\n",
+				dev->bus->location, dev->devnum);
+			usbi_device_index_remove(dev);
+			LIST_DEL(bus->devices, dev);
+			free_device(dev);
 			changes++;
-			dev = tdev;
 		}
 	}
 
@@ -697,43 +991,476 @@ API_EXPORTED int USBAPI_DECL usb_find_devices(void)
 	return changes;
 }
 
+API_EXPORTED int USBAPI_DECL usb_find_devices(void)
+{
+	return backend->find_devices();
+}
+
 API_EXPORTED struct usb_bus* USBAPI_DECL usb_get_busses(void)
 {
 	return usb_busses;
 }
 
-API_EXPORTED usb_dev_handle* USBAPI_DECL usb_open(struct usb_device *dev)
+///////////////////////////////////////
+/* endpoint statistics               */
+///////////////////////////////////////
+
+/* Opt-in per-endpoint transfer statistics, see usb_get_endpoint_stats().
+ * A handle and each async context set up on it share one reference counted
+ * block, so contexts may outlive the handle. Endpoints are indexed by
+ * number, with IN endpoints after OUT. */
+#define STATS_EP_COUNT		32
+#define STATS_EP_INDEX(ep)	(((ep) & 0x0f) | (((ep) & USB_ENDPOINT_IN) >> 3))
+
+struct usbi_stats {
+	volatile long ref_count;
+	MPL_MUTEX_T lock;
+	struct usb_endpoint_stats ep[STATS_EP_COUNT];
+};
+
+/* log-linear: 4 linear steps per power of two */
+static int stats_bucket(muint64_t us)
 {
-	int r;
-	usb_dev_handle *udev;
-	UD_DBG("\n");
+	int bucket;
+	int msb = 0;
+
+	if (us < 4)
+		return (int)us;
+	if (us > 0xffffffff)
+		return USB_STATS_BUCKETS - 1;
+
+	while ((us >> (msb + 1)) != 0)
+		msb++;
+	bucket = ((msb - 1) * 4) + (int)((us >> (msb - 2)) & 3);
+	return bucket < USB_STATS_BUCKETS ? bucket : USB_STATS_BUCKETS - 1;
+}
 
-	udev = malloc(sizeof(*udev));
-	if (!udev)
-		return NULL;
+static struct usbi_stats *stats_alloc(void)
+{
+	struct usbi_stats *stats = malloc(sizeof(*stats));
 
-	r = libusb_open((libusb_device *) dev->dev, &udev->handle);
-	if (r < 0) {
+	if (!stats)
+		return NULL;
+	memset(stats, 0, sizeof(*stats));
+	if (Mpl_Mutex_Init(&stats->lock) != MPL_SUCCESS) {
+		free(stats);
+		return NULL;
+	}
+	stats->ref_count = 1;
+	return stats;
+}
+
+static struct usbi_stats *stats_get(struct usbi_stats *stats)
+{
+	if (stats)
+		MPL_Atomic_Inc32(&stats->ref_count);
+	return stats;
+}
+
+static void stats_put(struct usbi_stats *stats)
+{
+	if (stats && MPL_Atomic_Dec32(&stats->ref_count) == 0) {
+		Mpl_Mutex_Free(&stats->lock);
+		free(stats);
+	}
+}
+
+/* result is the transfer length or a negative errno */
+/* cancelled transfers also report -ETIMEDOUT; they are counted apart */
+static void stats_complete(struct usbi_stats *stats, int ep, muint64_t us, int result, int cancelled)
+{
+	struct usb_endpoint_stats *ep_stats = &stats->ep[STATS_EP_INDEX(ep)];
+
+	Mpl_Mutex_Wait(&stats->lock);
+	ep_stats->transfers++;
+	if (result >= 0)
+		ep_stats->bytes += result;
+	else if (cancelled)
+		ep_stats->cancelled++;
+	else if (result == -ETIMEDOUT)
+		ep_stats->timeouts++;
+	else
+		ep_stats->errors++;
+	ep_stats->complete_hist[stats_bucket(us)]++;
+	Mpl_Mutex_Release(&stats->lock);
+}
+
+static void stats_reap(struct usbi_stats *stats, int ep, muint64_t us)
+{
+	Mpl_Mutex_Wait(&stats->lock);
+	stats->ep[STATS_EP_INDEX(ep)].reap_hist[stats_bucket(us)]++;
+	Mpl_Mutex_Release(&stats->lock);
+}
+
+API_EXPORTED int USBAPI_DECL usb_get_endpoint_stats(usb_dev_handle *dev, int ep, struct usb_endpoint_stats *stats, int reset)
+{
+	struct usb_endpoint_stats *ep_stats;
+
+	if (!dev || !stats) return -(errno=EINVAL);
+	if (!dev->stats) return -(errno=EOPNOTSUPP);
+
+	ep_stats = &dev->stats->ep[STATS_EP_INDEX(ep)];
+	Mpl_Mutex_Wait(&dev->stats->lock);
+	memcpy(stats, ep_stats, sizeof(*stats));
+	if (reset)
+		memset(ep_stats, 0, sizeof(*ep_stats));
+	Mpl_Mutex_Release(&dev->stats->lock);
+	return 0;
+}
+
+API_EXPORTED unsigned int USBAPI_DECL usb_stats_bucket_us(int bucket)
+{
+	if (bucket < 4)
+		return bucket < 0 ? 0 : bucket;
+	if (bucket >= USB_STATS_BUCKETS)
+		bucket = USB_STATS_BUCKETS - 1;
+	return (4 + (bucket & 3)) << ((bucket / 4) - 1);
+}
+
+///////////////////////////////////////
+/* in-flight tracking                */
+///////////////////////////////////////
+
+/* Every async context set up on a handle is linked into its in-flight
+ * block, which counts the transfers in flight per endpoint so that
+ * usb_cancel_endpoint() can cancel them in one pass and wait once. Like the
+ * statistics, the block is shared by reference with the contexts. */
+struct usbi_inflight {
+	volatile long ref_count;
+	MPL_MUTEX_T lock;
+	usb_async_transfer_t *contexts;
+	volatile long count[STATS_EP_COUNT];
+
+	/* set whenever a count drops to zero */
+	MPL_EVENT_T drained;
+};
+
+static struct usbi_inflight *inflight_alloc(void)
+{
+	struct usbi_inflight *inflight = malloc(sizeof(*inflight));
+
+	if (!inflight)
+		return NULL;
+	memset(inflight, 0, sizeof(*inflight));
+	if (Mpl_Mutex_Init(&inflight->lock) != MPL_SUCCESS) {
+		free(inflight);
+		return NULL;
+	}
+	if (Mpl_Event_Init(&inflight->drained, 0, 1) != MPL_SUCCESS) {
+		Mpl_Mutex_Free(&inflight->lock);
+		free(inflight);
+		return NULL;
+	}
+	inflight->ref_count = 1;
+	return inflight;
+}
+
+static void inflight_put(struct usbi_inflight *inflight)
+{
+	if (inflight && MPL_Atomic_Dec32(&inflight->ref_count) == 0) {
+		Mpl_Event_Free(&inflight->drained);
+		Mpl_Mutex_Free(&inflight->lock);
+		free(inflight);
+	}
+}
+
+static void inflight_link(struct usbi_inflight *inflight, usb_async_transfer_t *async_context)
+{
+	MPL_Atomic_Inc32(&inflight->ref_count);
+	async_context->inflight = inflight;
+
+	Mpl_Mutex_Wait(&inflight->lock);
+	async_context->inflight_prev = NULL;
+	async_context->inflight_next = inflight->contexts;
+	if (inflight->contexts)
+		inflight->contexts->inflight_prev = async_context;
+	inflight->contexts = async_context;
+	Mpl_Mutex_Release(&inflight->lock);
+}
+
+static void inflight_unlink(usb_async_transfer_t *async_context)
+{
+	struct usbi_inflight *inflight = async_context->inflight;
+
+	if (!inflight)
+		return;
+
+	Mpl_Mutex_Wait(&inflight->lock);
+	if (async_context->inflight_prev)
+		async_context->inflight_prev->inflight_next = async_context->inflight_next;
+	else
+		inflight->contexts = async_context->inflight_next;
+	if (async_context->inflight_next)
+		async_context->inflight_next->inflight_prev = async_context->inflight_prev;
+	Mpl_Mutex_Release(&inflight->lock);
+
+	async_context->inflight = NULL;
+	inflight_put(inflight);
+}
+
+static void inflight_begin(usb_async_transfer_t *async_context)
+{
+	async_context->submitted = 1;
+	MPL_Atomic_Inc32(&async_context->inflight->count[STATS_EP_INDEX(async_context->transfer->endpoint)]);
+}
+
+/* takes the block rather than the context, which completions may have
+ * handed back by the time they end their count */
+static void inflight_end(struct usbi_inflight *inflight, unsigned char endpoint)
+{
+	if (MPL_Atomic_Dec32(&inflight->count[STATS_EP_INDEX(endpoint)]) == 0)
+		Mpl_Event_Set(&inflight->drained);
+}
+
+/* undoes inflight_begin() for a transfer that failed to submit */
+static void inflight_abort(usb_async_transfer_t *async_context)
+{
+	async_context->submitted = 0;
+	inflight_end(async_context->inflight, async_context->transfer->endpoint);
+}
+
+///////////////////////////////////////
+/* transfer buffers                  */
+///////////////////////////////////////
+
+/* usb_free_buffer() needs to know where a buffer came from and, for kernel
+ * memory, its size; the handle keeps a list of them. usb_close() frees the
+ * buffers, but streams hold a reference to the list itself, so that one
+ * closed after its handle finds its buffer gone rather than the list. */
+struct usbi_buffer {
+	struct usbi_buffer *next;
+	void *buffer;
+	size_t size;
+	int dev_mem;
+};
+
+struct usbi_buffers {
+	MPL_MUTEX_T lock;
+	volatile long ref_count;
+
+	/* the handle, NULL once usb_close() has emptied the list */
+	usb_dev_handle *dev;
+	struct usbi_buffer *list;
+};
+
+static void *buffer_heap_alloc(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, BUFFER_ALIGN);
+#else
+	void *buffer;
+	return posix_memalign(&buffer, BUFFER_ALIGN, size) == 0 ? buffer : NULL;
+#endif
+}
+
+static void buffer_heap_free(void *buffer)
+{
+#ifdef _WIN32
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+}
+
+static void buffer_release(usb_dev_handle *dev, struct usbi_buffer *entry)
+{
+	if (entry->dev_mem)
+		backend->dev_mem_free(dev, entry->buffer, entry->size);
+	else
+		buffer_heap_free(entry->buffer);
+	free(entry);
+}
+
+/* the list is set up by the first usb_alloc_buffer() on the handle */
+static struct usbi_buffers *buffers_setup(usb_dev_handle *dev)
+{
+	struct usbi_buffers *buffers = dev->buffers;
+
+	if (buffers)
+		return buffers;
+
+	if ((buffers = malloc(sizeof(*buffers))) == NULL)
+		return NULL;
+	memset(buffers, 0, sizeof(*buffers));
+	if (Mpl_Mutex_Init(&buffers->lock) != MPL_SUCCESS) {
+		free(buffers);
+		return NULL;
+	}
+	buffers->ref_count = 1;
+	buffers->dev = dev;
+	if (!MPL_Atomic_CmpExgPtr(&dev->buffers, buffers, NULL)) {
+		Mpl_Mutex_Free(&buffers->lock);
+		free(buffers);
+	}
+	return dev->buffers;
+}
+
+static struct usbi_buffers *buffers_get(struct usbi_buffers *buffers)
+{
+	if (buffers)
+		MPL_Atomic_Inc32(&buffers->ref_count);
+	return buffers;
+}
+
+static void buffers_put(struct usbi_buffers *buffers)
+{
+	if (buffers && MPL_Atomic_Dec32(&buffers->ref_count) == 0) {
+		Mpl_Mutex_Free(&buffers->lock);
+		free(buffers);
+	}
+}
+
+/* frees a buffer of the list; -EINVAL if it is not on it */
+static int buffers_remove(struct usbi_buffers *buffers, void *buffer)
+{
+	struct usbi_buffer **link, *entry = NULL;
+	usb_dev_handle *dev;
+
+	Mpl_Mutex_Wait(&buffers->lock);
+	dev = buffers->dev;
+	for (link = &buffers->list; *link; link = &(*link)->next) {
+		if ((*link)->buffer == buffer) {
+			entry = *link;
+			*link = entry->next;
+			break;
+		}
+	}
+	Mpl_Mutex_Release(&buffers->lock);
+
+	if (!entry) return -EINVAL;
+	buffer_release(dev, entry);
+	return 0;
+}
+
+/* frees what is left on the list and drops the handle's reference */
+static void buffers_close(usb_dev_handle *dev)
+{
+	struct usbi_buffers *buffers = dev->buffers;
+	struct usbi_buffer *entry, *next;
+
+	if (!buffers)
+		return;
+
+	Mpl_Mutex_Wait(&buffers->lock);
+	entry = buffers->list;
+	buffers->list = NULL;
+	buffers->dev = NULL;
+	Mpl_Mutex_Release(&buffers->lock);
+
+	for (; entry; entry = next) {
+		next = entry->next;
+		buffer_release(dev, entry);
+	}
+	dev->buffers = NULL;
+	buffers_put(buffers);
+}
+
+API_EXPORTED void * USBAPI_DECL usb_alloc_buffer(usb_dev_handle *dev, size_t size)
+{
+	struct usbi_buffers *buffers;
+	struct usbi_buffer *entry;
+
+	if (!dev || !size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((buffers = buffers_setup(dev)) == NULL ||
+		(entry = malloc(sizeof(*entry))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	entry->size = size;
+	entry->dev_mem = 1;
+	if ((entry->buffer = backend->dev_mem_alloc(dev, size)) == NULL) {
+		entry->dev_mem = 0;
+		if ((entry->buffer = buffer_heap_alloc(size)) == NULL) {
+			free(entry);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	Mpl_Mutex_Wait(&buffers->lock);
+	entry->next = buffers->list;
+	buffers->list = entry;
+	Mpl_Mutex_Release(&buffers->lock);
+
+	UD_DBG("%s buffer of %u bytes\n", entry->dev_mem ? "kernel" : "heap",
+		(unsigned int)size);
+	return entry->buffer;
+}
+
+API_EXPORTED int USBAPI_DECL usb_free_buffer(usb_dev_handle *dev, void *buffer)
+{
+	int r;
+
+	if (!dev || !buffer || !dev->buffers) return -(errno=EINVAL);
+
+	if ((r = buffers_remove(dev->buffers, buffer)) < 0)
+		errno = -r;
+	return r;
+}
+
+API_EXPORTED usb_dev_handle* USBAPI_DECL usb_open(struct usb_device *dev)
+{
+	int r;
+	usb_dev_handle *udev;
+	UD_DBG("\n");
+
+	udev = malloc(sizeof(*udev));
+	if (!udev)
+		return NULL;
+
+	udev->handle = NULL;
+	udev->device = dev;
+	udev->async_pool = NULL;
+	udev->stats = NULL;
+	udev->buffers = NULL;
+	udev->sync_io = NULL;
+
+	udev->inflight = inflight_alloc();
+	if (!udev->inflight) {
+		free(udev);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	r = backend->open(udev);
+	if (r < 0) {
 		if (r == LIBUSB_ERROR_ACCESS) {
 			UD_INFO("Device open failed due to a permission denied error.\n");
 			UD_INFO("libusb requires write access to USB device nodes.\n");
 		}
 		UD_ERR("could not open device, error %d\n", r);
+		inflight_put(udev->inflight);
 		free(udev);
 		errno = libusb_to_errno(r);
 		return NULL;
 	}
 
 	udev->last_claimed_interface = -1;
-	udev->device = dev;
+	if (stats_enabled && (udev->stats = stats_alloc()) == NULL)
+		UD_WRN("could not allocate endpoint statistics\n");
 
 	return udev;
 }
 
+static void async_pool_close(usb_async_pool_t *pool);
+
 API_EXPORTED int USBAPI_DECL usb_close(usb_dev_handle *dev)
 {
 	UD_DBG("\n");
-	libusb_close(dev->handle);
+	/* transfers may still be reading into buffers that are freed below */
+	if (drain_on_close || dev->buffers)
+		usb_cancel_endpoint(dev, -1);
+	if (dev->async_pool)
+		async_pool_close(dev->async_pool);
+	inflight_put(dev->inflight);
+	stats_put(dev->stats);
+	sync_io_close(dev);
+	buffers_close(dev);
+	backend->close(dev);
 	free(dev);
 	return 0;
 }
@@ -746,7 +1473,7 @@ API_EXPORTED struct usb_device* USBAPI_DECL usb_device(usb_dev_handle *dev)
 API_EXPORTED int USBAPI_DECL usb_set_configuration(usb_dev_handle *dev, int configuration)
 {
 	UD_DBG("configuration %d\n", configuration);
-	return compat_err(libusb_set_configuration(dev->handle, configuration));
+	return compat_err(backend->set_configuration(dev, configuration));
 }
 
 API_EXPORTED int USBAPI_DECL usb_claim_interface(usb_dev_handle *dev, int interface)
@@ -754,7 +1481,7 @@ API_EXPORTED int USBAPI_DECL usb_claim_interface(usb_dev_handle *dev, int interf
 	int r;
 	UD_DBG("interface %d\n", interface);
 
-	r = libusb_claim_interface(dev->handle, interface);
+	r = backend->claim_interface(dev, interface);
 	if (r == 0) {
 		dev->last_claimed_interface = interface;
 		return 0;
@@ -768,7 +1495,7 @@ API_EXPORTED int USBAPI_DECL usb_release_interface(usb_dev_handle *dev, int inte
 	int r;
 	UD_DBG("interface %d\n", interface);
 
-	r = libusb_release_interface(dev->handle, interface);
+	r = backend->release_interface(dev, interface);
 	if (r == 0)
 		dev->last_claimed_interface = -1;
 
@@ -781,7 +1508,7 @@ API_EXPORTED int USBAPI_DECL usb_set_altinterface(usb_dev_handle *dev, int alter
 	if (dev->last_claimed_interface < 0)
 		return -(errno=EINVAL);
 	
-	return compat_err(libusb_set_interface_alt_setting(dev->handle,
+	return compat_err(backend->set_interface_alt_setting(dev,
 		dev->last_claimed_interface, alternate));
 }
 
@@ -793,18 +1520,19 @@ API_EXPORTED int USBAPI_DECL usb_resetep(usb_dev_handle *dev, unsigned int ep)
 API_EXPORTED int USBAPI_DECL usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
 {
 	UD_DBG("endpoint %x\n", ep);
-	return compat_err(libusb_clear_halt(dev->handle, ep & 0xff));
+	return compat_err(backend->clear_halt(dev, ep & 0xff));
 }
 
 API_EXPORTED int USBAPI_DECL usb_reset(usb_dev_handle *dev)
 {
 	UD_DBG("\n");
-	return compat_err(libusb_reset_device(dev->handle));
+	return compat_err(backend->reset_device(dev));
 }
 
 static int usb_bulk_io(usb_dev_handle *dev, int ep, char *bytes,
 	int size, int timeout)
 {
+	muint64_t start = dev->stats ? Mpl_Clock_Ticks_Us() : 0;
 	int actual_length;
 	int r;
 
@@ -812,21 +1540,31 @@ static int usb_bulk_io(usb_dev_handle *dev, int ep, char *bytes,
 	if (errno==ETIMEDOUT) errno=0;
 
 	UD_DBG("endpoint %x size %d timeout %d\n", ep, size, timeout);
-	r = libusb_bulk_transfer(dev->handle, ep & 0xff, (unsigned char*)&bytes[0], size,
-		&actual_length, timeout);
+	if (sync_through_async)
+		r = sync_io_transfer(dev, LIBUSB_TRANSFER_TYPE_BULK, ep & 0xff,
+			(unsigned char*)&bytes[0], size, &actual_length, timeout);
+	else
+		r = backend->bulk_transfer(dev, ep & 0xff, (unsigned char*)&bytes[0], size,
+			&actual_length, timeout);
 	
 	/* if we timed out but did transfer some data, report as successful short
 	 * read. FIXME: is this how libusb-0.1 works?
 	 * - Travis: Fixed
 	     This is a bug in libusb-win32 which will be fixed accordingly.	*/
 	if (r == LIBUSB_SUCCESS) {
-		return actual_length;
+		r = actual_length;
 	}
 	else if (r == LIBUSB_ERROR_TIMEOUT && actual_length > 0) {
 		errno = ETIMEDOUT;
-		return actual_length;
+		r = actual_length;
 	}
-	return compat_err(r);
+	else {
+		r = compat_err(r);
+	}
+
+	if (dev->stats)
+		stats_complete(dev->stats, ep, Mpl_Clock_Ticks_Us() - start, r, 0);
+	return r;
 }
 
 API_EXPORTED int USBAPI_DECL usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes,
@@ -860,6 +1598,7 @@ API_EXPORTED int USBAPI_DECL usb_bulk_write(usb_dev_handle *dev, int ep, char *b
 static int usb_interrupt_io(usb_dev_handle *dev, int ep, char *bytes,
 	int size, int timeout)
 {
+	muint64_t start = dev->stats ? Mpl_Clock_Ticks_Us() : 0;
 	int actual_length;
 	int r;
 	UD_DBG("endpoint %x size %d timeout %d\n", ep, size, timeout);
@@ -867,21 +1606,31 @@ static int usb_interrupt_io(usb_dev_handle *dev, int ep, char *bytes,
 	/* Travis: Fixed */
 	if (errno==ETIMEDOUT) errno=0;
 
-	r = libusb_interrupt_transfer(dev->handle, ep & 0xff, (unsigned char*)&bytes[0], size,
-		&actual_length, timeout);
+	if (sync_through_async)
+		r = sync_io_transfer(dev, LIBUSB_TRANSFER_TYPE_INTERRUPT, ep & 0xff,
+			(unsigned char*)&bytes[0], size, &actual_length, timeout);
+	else
+		r = backend->interrupt_transfer(dev, ep & 0xff, (unsigned char*)&bytes[0], size,
+			&actual_length, timeout);
 	
 	/* if we timed out but did transfer some data, report as successful short
 	 * read. FIXME: is this how libusb-0.1 works?
 	 * - Travis: Fixed
 	     This is a bug in libusb-win32 which will be fixed accordingly.	*/
 	if (r == LIBUSB_SUCCESS) {
-		return actual_length;
+		r = actual_length;
 	}
 	else if (r == LIBUSB_ERROR_TIMEOUT && actual_length > 0) {
 		errno = ETIMEDOUT;
-		return actual_length;
+		r = actual_length;
 	}
-	return compat_err(r);
+	else {
+		r = compat_err(r);
+	}
+
+	if (dev->stats)
+		stats_complete(dev->stats, ep, Mpl_Clock_Ticks_Us() - start, r, 0);
+	return r;
 }
 
 API_EXPORTED int USBAPI_DECL usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes,
@@ -914,26 +1663,35 @@ API_EXPORTED int USBAPI_DECL usb_interrupt_write(usb_dev_handle *dev, int ep, ch
 API_EXPORTED int USBAPI_DECL usb_control_msg(usb_dev_handle *dev, int bmRequestType,
 	int bRequest, int wValue, int wIndex, char *bytes, int size, int timeout)
 {
+	muint64_t start = dev->stats ? Mpl_Clock_Ticks_Us() : 0;
 	int r;
 	UD_DBG("RQT=%x RQ=%x V=%x I=%x len=%d timeout=%d\n", bmRequestType,
 		bRequest, wValue, wIndex, size, timeout);
 
-	r = libusb_control_transfer(dev->handle, bmRequestType & 0xff,
-		bRequest & 0xff, wValue & 0xffff, wIndex & 0xffff, (unsigned char*)&bytes[0], size & 0xffff,
-		timeout);
+	if (sync_through_async)
+		r = sync_io_control(dev, bmRequestType & 0xff,
+			bRequest & 0xff, wValue & 0xffff, wIndex & 0xffff, (unsigned char*)&bytes[0], size & 0xffff,
+			timeout);
+	else
+		r = backend->control_transfer(dev, bmRequestType & 0xff,
+			bRequest & 0xff, wValue & 0xffff, wIndex & 0xffff, (unsigned char*)&bytes[0], size & 0xffff,
+			timeout);
 
-	if (r >= 0)
-		return r;
+	if (r < 0)
+		r = compat_err(r);
 
-	return compat_err(r);
+	if (dev->stats)
+		stats_complete(dev->stats, 0, Mpl_Clock_Ticks_Us() - start, r, 0);
+	return r;
 }
 
 API_EXPORTED int USBAPI_DECL usb_get_string(usb_dev_handle *dev, int desc_index, int langid,
 	char *buf, size_t buflen)
 {
 	int r;
-	r = libusb_get_string_descriptor(dev->handle, desc_index & 0xff,
-		langid & 0xffff, (unsigned char*)&buf[0], (int) buflen);
+	r = backend->control_transfer(dev, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, (uint16_t)((USB_DT_STRING << 8) | (desc_index & 0xff)),
+		langid & 0xffff, (unsigned char*)&buf[0], (uint16_t) buflen, 1000);
 	if (r >= 0)
 		return r;
 	return compat_err(r);
@@ -943,7 +1701,7 @@ API_EXPORTED int USBAPI_DECL usb_get_string_simple(usb_dev_handle *dev, int desc
 	char *buf, size_t buflen)
 {
 	int r;
-	r = libusb_get_string_descriptor_ascii(dev->handle, desc_index & 0xff,
+	r = backend->get_string_descriptor_ascii(dev, desc_index & 0xff,
 		(unsigned char*)&buf[0], (int) buflen);
 	if (r >= 0)
 		return r;
@@ -954,7 +1712,9 @@ API_EXPORTED int USBAPI_DECL usb_get_descriptor(usb_dev_handle *dev, unsigned ch
 	unsigned char desc_index, void *buf, int size)
 {
 	int r;
-	r = libusb_get_descriptor(dev->handle, type, desc_index, buf, size);
+	r = backend->control_transfer(dev, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, (uint16_t)((type << 8) | desc_index), 0,
+		buf, (uint16_t)size, 1000);
 	if (r >= 0)
 		return r;
 	return compat_err(r);
@@ -967,7 +1727,7 @@ API_EXPORTED int USBAPI_DECL usb_get_descriptor_by_endpoint(usb_dev_handle *dev,
 	 * getting a descriptor "by endpoint". libusb-1.0 does not provide this
 	 * functionality so we just send a control message directly */
 	int r;
-	r = libusb_control_transfer(dev->handle,
+	r = backend->control_transfer(dev,
 		LIBUSB_ENDPOINT_IN | (ep & 0xff), LIBUSB_REQUEST_GET_DESCRIPTOR,
 		(uint16_t)((type << 8) | desc_index), 0, buf, (uint16_t)size, 1000);
 	if (r >= 0)
@@ -978,7 +1738,7 @@ API_EXPORTED int USBAPI_DECL usb_get_descriptor_by_endpoint(usb_dev_handle *dev,
 API_EXPORTED int USBAPI_DECL usb_get_driver_np(usb_dev_handle *dev, int interface,
 	char *name, unsigned int namelen)
 {
-	int r = libusb_kernel_driver_active(dev->handle, interface);
+	int r = backend->kernel_driver_active(dev, interface);
 	if (r == 1) {
 		/* libusb-1.0 doesn't expose driver name, so fill in a dummy value */
 		snprintf(name, namelen, "dummy");
@@ -992,7 +1752,7 @@ API_EXPORTED int USBAPI_DECL usb_get_driver_np(usb_dev_handle *dev, int interfac
 
 API_EXPORTED int USBAPI_DECL usb_detach_kernel_driver_np(usb_dev_handle *dev, int interface)
 {
-	int r = compat_err(libusb_detach_kernel_driver(dev->handle, interface));
+	int r = compat_err(backend->detach_kernel_driver(dev, interface));
 	switch (r) {
 	case LIBUSB_SUCCESS:
 		return 0;
@@ -1011,428 +1771,3400 @@ API_EXPORTED int USBAPI_DECL usb_detach_kernel_driver_np(usb_dev_handle *dev, in
 	}
 }
 
+#ifdef HAVE_LIBUSB_HOTPLUG
 ///////////////////////////////////////
-/* libusb0(M)ulti-platform Functions */
+/* libusb-1.0 hotplug device tracking */
 ///////////////////////////////////////
 
-#ifdef _MSC_VER
-
-/* Workaround for testing on windows via libusbX.*/
-#ifndef CLOCK_REALTIME
-#define CLOCK_REALTIME 1
+/* runs from libusb event handling; only queue the change here, the
+ * descriptors are read from usb_find_devices() */
+static int LIBUSB_CALL hotplug_cb(libusb_context *context, libusb_device *newlib_dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_change *change;
 
-/*
- * time between jan 1, 1601 and jan 1, 1970 in units of 100 nanoseconds
- */
-#ifndef PTW32_TIMESPEC_TO_FILETIME_OFFSET
-#define PTW32_TIMESPEC_TO_FILETIME_OFFSET ( ((LONGLONG) 27111902 << 32) + (LONGLONG) 3577643008 )
-#endif
+	change = malloc(sizeof(*change));
+	if (!change) {
+		UD_ERR("dropped hotplug event %d\n", event);
+		return 0;
+	}
+	change->next = NULL;
+	change->dev = libusb_ref_device(newlib_dev);
+	change->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+
+	Mpl_Mutex_Wait(&hotplug.lock);
+	if (hotplug.tail)
+		hotplug.tail->next = change;
+	else
+		hotplug.head = change;
+	hotplug.tail = change;
+	Mpl_Mutex_Release(&hotplug.lock);
 
-static void filetime_to_timespec (const FILETIME * ft, struct timespec *ts)
-     /*
-      * -------------------------------------------------------------------
-      * converts FILETIME (as set by GetSystemTimeAsFileTime), where the time is
-      * expressed in 100 nanoseconds from Jan 1, 1601,
-      * into struct timespec
-      * where the time is expressed in seconds and nanoseconds from Jan 1, 1970.
-      * -------------------------------------------------------------------
-      */
-{
-  ts->tv_sec = (int) ((*(LONGLONG *) ft - PTW32_TIMESPEC_TO_FILETIME_OFFSET) / 10000000);
-  ts->tv_nsec = (int) ((*(LONGLONG *) ft - PTW32_TIMESPEC_TO_FILETIME_OFFSET - ((LONGLONG) ts->tv_sec * (LONGLONG) 10000000)) * 100);
+	return 0;
 }
 
-static int clock_gettime(int clock_id, struct timespec * abstime)
+static int hotplug_register(void)
 {
-  const int64_t NANOSEC_PER_MILLISEC = 1000000;
-  const int64_t MILLISEC_PER_SEC = 1000;
-  int64_t absMilliseconds;
-  FILETIME ft;
+	int r;
 
-  /* get current system time */
-  GetSystemTimeAsFileTime(&ft);
-  filetime_to_timespec(&ft, abstime);
-  absMilliseconds = (int64_t)abstime->tv_sec * MILLISEC_PER_SEC;
-  absMilliseconds += ((int64_t)abstime->tv_nsec + (NANOSEC_PER_MILLISEC/2)) / NANOSEC_PER_MILLISEC;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-  abstime->tv_nsec = (long)((absMilliseconds % 1000) * NANOSEC_PER_MILLISEC);
-  abstime->tv_sec = (long)(absMilliseconds / MILLISEC_PER_SEC);
+	if ((r = Mpl_Mutex_Init(&hotplug.lock)) != MPL_SUCCESS)
+		return LIBUSB_ERROR_NO_MEM;
 
-  return 0;
-}
+	/* the enumerate flag queues every device already present as an
+	 * arrival, which gives the first usb_find_devices() its list */
+	r = libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_cb, NULL, &hotplug.handle);
+	if (r != LIBUSB_SUCCESS) {
+		Mpl_Mutex_Free(&hotplug.lock);
+		return r;
+	}
 
-#endif
-#endif // _MSC_VER
+	hotplug.registered = 1;
+	return 0;
+}
 
-static void clock_add_rel_ms(int rel_ms, struct timespec * abstime)
+static void hotplug_deregister(void)
 {
-  const int64_t NANOSEC_PER_MILLISEC = 1000000;
-  const int64_t MILLISEC_PER_SEC = 1000;
-  int64_t absMilliseconds;
+	struct hotplug_change *change;
 
-  absMilliseconds = rel_ms;
-  absMilliseconds += (int64_t)abstime->tv_sec * MILLISEC_PER_SEC;
-  absMilliseconds += ((int64_t)abstime->tv_nsec + (NANOSEC_PER_MILLISEC/2)) / NANOSEC_PER_MILLISEC;
+	if (!hotplug.registered)
+		return;
 
-  abstime->tv_nsec = (long)((absMilliseconds % 1000) * NANOSEC_PER_MILLISEC);
-  abstime->tv_sec = (long)(absMilliseconds / MILLISEC_PER_SEC);
+	libusb_hotplug_deregister_callback(ctx, hotplug.handle);
+	while ((change = hotplug.head) != NULL) {
+		hotplug.head = change->next;
+		libusb_unref_device(change->dev);
+		free(change);
+	}
+	hotplug.tail = NULL;
+	Mpl_Mutex_Free(&hotplug.lock);
+	hotplug.registered = 0;
 }
 
-static int libusb_transfer_to_errno(int status)
+/* delivers hotplug events without blocking. if the async event thread
+ * is handling events it delivers them instead. */
+static void hotplug_poll(void)
 {
-	switch (status) {
-
-	case LIBUSB_TRANSFER_COMPLETED:
-		return 0;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-	case LIBUSB_TRANSFER_CANCELLED:
-		return ETIMEDOUT;
-	case LIBUSB_TRANSFER_STALL:
-		return EIO;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		return ENODEV;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		return EOVERFLOW;
-	}
-
-	return EFAULT;
+	struct timeval tv = {0, 0};
+	libusb_handle_events_timeout_completed(ctx, &tv, NULL);
 }
 
-static MPL_THDPROC_RETURN_TYPE MPL_THDPROC_CC async_event_handler(void *arg) 
+/* busses that still have devices plus busses of pending arrivals */
+static int hotplug_find_busses(struct usb_bus **ret)
 {
-	struct timeval event_timeout_timeval;
-	int r;
-	int events_locked=0;
+	unsigned char present[256 / 8];
+	struct hotplug_change *change;
+	struct usb_bus *busses = NULL;
+	struct usb_bus *bus;
+	int i;
 
-	event_timeout_timeval.tv_sec  = ASYNC_TIMVAL_SEC;
-	event_timeout_timeval.tv_usec = 0;
+	hotplug_poll();
+	memset(present, 0, sizeof(present));
 
-	if ((r=Mpl_Event_Wait(&async_thread.event_running, INFINITE)) != MPL_SUCCESS)
-	{
-		UD_ERR("Mpl_Event_Wait failed. ret=%d\n",r);
-		goto Done;
+	for (bus = usb_busses; bus; bus = bus->next) {
+		if (bus->devices && bus->location < 256)
+			present[bus->location / 8] |= 1 << (bus->location % 8);
+	}
+
+	Mpl_Mutex_Wait(&hotplug.lock);
+	for (change = hotplug.head; change; change = change->next) {
+		if (change->arrived) {
+			uint8_t bus_num = libusb_get_bus_number(change->dev);
+			present[bus_num / 8] |= 1 << (bus_num % 8);
+		}
+	}
+	Mpl_Mutex_Release(&hotplug.lock);
+
+	for (i = 0; i < 256; i++) {
+		if (!(present[i / 8] & (1 << (i % 8))))
+			continue;
+
+		bus = malloc(sizeof(*bus));
+		if (!bus) {
+			while ((bus = busses) != NULL) {
+				busses = bus->next;
+				free(bus);
+			}
+			return -ENOMEM;
+		}
+		memset(bus, 0, sizeof(*bus));
+		bus->location = i;
+		sprintf(bus->dirname, "%03d", i);
+		LIST_ADD(busses, bus);
+	}
+
+	*ret = busses;
+	return 0;
+}
+
+static struct usb_bus *hotplug_get_bus(uint8_t bus_num)
+{
+	struct usb_bus *bus;
+
+	for (bus = usb_busses; bus; bus = bus->next) {
+		if (bus->location == bus_num)
+			return bus;
+	}
+
+	/* the device arrived after the last usb_find_busses() */
+	bus = malloc(sizeof(*bus));
+	if (!bus)
+		return NULL;
+	memset(bus, 0, sizeof(*bus));
+	bus->location = bus_num;
+	sprintf(bus->dirname, "%03d", bus_num);
+	LIST_ADD(usb_busses, bus);
+	return bus;
+}
+
+static int hotplug_add_device(libusb_device *newlib_dev)
+{
+	struct usb_bus *bus;
+	struct usb_device *dev;
+	int r;
+
+	bus = hotplug_get_bus(libusb_get_bus_number(newlib_dev));
+	if (!bus)
+		return -ENOMEM;
+
+	dev = usbi_device_index_find(bus->location, libusb_get_device_address(newlib_dev));
+	if (dev && dev->dev == newlib_dev)
+		return 0;
+
+	dev = malloc(sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+	memset(dev, 0, sizeof(*dev));
+
+	dev->dev = newlib_dev;
+	dev->bus = bus;
+	dev->devnum = libusb_get_device_address(newlib_dev);
+	sprintf(dev->filename, "%03d", dev->devnum);
+
+	r = initialize_device(dev);
+	if (r < 0) {
+		UD_ERR("couldn't initialize device %d.%d (error %d)\n",
+			bus->location, dev->devnum, r);
+		free(dev);
+		return r;
+	}
+	if ((r = usbi_device_index_add(dev)) < 0) {
+		free_device(dev);
+		return r;
+	}
+
+	UD_DBG("device %d.%d added\n", bus->location, dev->devnum);
+	LIST_ADD(bus->devices, dev);
+	return 1;
+}
+
+static int hotplug_remove_device(libusb_device *newlib_dev)
+{
+	struct usb_device *dev;
+
+	dev = usbi_device_index_find(libusb_get_bus_number(newlib_dev),
+		libusb_get_device_address(newlib_dev));
+	if (!dev || dev->dev != newlib_dev)
+		return 0;
+
+	UD_DBG("device %d.%d removed\n", dev->bus->location, dev->devnum);
+	usbi_device_index_remove(dev);
+	LIST_DEL(dev->bus->devices, dev);
+	free_device(dev);
+	return 1;
+}
+
+/* applies the queued changes to usb_busses; O(changes) */
+static int hotplug_find_devices(void)
+{
+	struct hotplug_change *changes;
+	struct hotplug_change *change;
+	int count = 0;
+	int r;
+
+	hotplug_poll();
+
+	Mpl_Mutex_Wait(&hotplug.lock);
+	changes = hotplug.head;
+	hotplug.head = hotplug.tail = NULL;
+	Mpl_Mutex_Release(&hotplug.lock);
+
+	while ((change = changes) != NULL) {
+		changes = change->next;
+
+		if (change->arrived)
+			r = hotplug_add_device(change->dev);
+		else
+			r = hotplug_remove_device(change->dev);
+		if (r > 0)
+			count++;
+
+		libusb_unref_device(change->dev);
+		free(change);
+	}
+
+	return count;
+}
+
+#endif /* HAVE_LIBUSB_HOTPLUG */
+
+///////////////////////////////////////
+/* libusb-1.0 backend                */
+///////////////////////////////////////
+
+static int libusb10_init(const struct usb_init_params *params)
+{
+#ifdef HAVE_LIBUSB_HOTPLUG
+	int r;
+#endif
+
+	usb_init();
+	if (!ctx)
+		return errno ? -errno : -EIO;
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+	/* usb_find_devices() rescans the bus while hotplug is off */
+	if (params->hotplug && (r = hotplug_register()) != 0)
+		UD_WRN("hotplug unavailable (%d); falling back to rescans\n", r);
+#endif
+	return 0;
+}
+
+static void libusb10_exit(void)
+{
+#ifdef HAVE_LIBUSB_HOTPLUG
+	hotplug_deregister();
+#endif
+	libusb_exit(ctx);
+	ctx = NULL;
+}
+
+static int libusb10_open(usb_dev_handle *udev)
+{
+	return libusb_open((libusb_device *) udev->device->dev, &udev->handle);
+}
+
+static void libusb10_close(usb_dev_handle *udev)
+{
+	libusb_close(udev->handle);
+}
+
+static int libusb10_set_configuration(usb_dev_handle *udev, int configuration)
+{
+	return libusb_set_configuration(udev->handle, configuration);
+}
+
+static int libusb10_claim_interface(usb_dev_handle *udev, int interface)
+{
+	return libusb_claim_interface(udev->handle, interface);
+}
+
+static int libusb10_release_interface(usb_dev_handle *udev, int interface)
+{
+	return libusb_release_interface(udev->handle, interface);
+}
+
+static int libusb10_set_interface_alt_setting(usb_dev_handle *udev,
+	int interface, int alternate)
+{
+	return libusb_set_interface_alt_setting(udev->handle, interface, alternate);
+}
+
+static int libusb10_clear_halt(usb_dev_handle *udev, unsigned char ep)
+{
+	return libusb_clear_halt(udev->handle, ep);
+}
+
+static int libusb10_reset_device(usb_dev_handle *udev)
+{
+	return libusb_reset_device(udev->handle);
+}
+
+static int libusb10_kernel_driver_active(usb_dev_handle *udev, int interface)
+{
+	return libusb_kernel_driver_active(udev->handle, interface);
+}
+
+static int libusb10_detach_kernel_driver(usb_dev_handle *udev, int interface)
+{
+	return libusb_detach_kernel_driver(udev->handle, interface);
+}
+
+static int libusb10_control_transfer(usb_dev_handle *udev, uint8_t bmRequestType,
+	uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data,
+	uint16_t wLength, unsigned int timeout)
+{
+	return sync_io_control(udev, bmRequestType, bRequest, wValue, wIndex,
+		data, wLength, timeout);
+}
+
+static int libusb10_bulk_transfer(usb_dev_handle *udev, unsigned char ep,
+	unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+	return sync_io_transfer(udev, LIBUSB_TRANSFER_TYPE_BULK, ep, data,
+		length, actual_length, timeout);
+}
+
+static int libusb10_interrupt_transfer(usb_dev_handle *udev, unsigned char ep,
+	unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+	return sync_io_transfer(udev, LIBUSB_TRANSFER_TYPE_INTERRUPT, ep, data,
+		length, actual_length, timeout);
+}
+
+static int libusb10_get_string_descriptor_ascii(usb_dev_handle *udev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	return libusb_get_string_descriptor_ascii(udev->handle, desc_index,
+		data, length);
+}
+
+static int libusb10_submit_transfer(struct libusb_transfer *transfer)
+{
+	return libusb_submit_transfer(transfer);
+}
+
+static int libusb10_cancel_transfer(struct libusb_transfer *transfer)
+{
+	return libusb_cancel_transfer(transfer);
+}
+
+static void libusb10_lock_events(void)
+{
+	libusb_lock_events(ctx);
+}
+
+static void libusb10_unlock_events(void)
+{
+	libusb_unlock_events(ctx);
+}
+
+static int libusb10_event_handling_ok(void)
+{
+	return libusb_event_handling_ok(ctx);
+}
+
+static int libusb10_handle_events_locked(struct timeval *tv)
+{
+	return libusb_handle_events_locked(ctx, tv);
+}
+
+static int libusb10_handle_events_completed(struct timeval *tv, int *completed)
+{
+	return libusb_handle_events_timeout_completed(ctx, tv, completed);
+}
+
+static int libusb10_get_pollfds(struct usb_pollfd *fds, int max)
+{
+	const struct libusb_pollfd **pollfds = libusb_get_pollfds(ctx);
+	int count;
+
+	/* not available on windows */
+	if (!pollfds)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	for (count = 0; pollfds[count]; count++) {
+		if (count < max) {
+			fds[count].fd = pollfds[count]->fd;
+			fds[count].events = pollfds[count]->events;
+		}
+	}
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+	libusb_free_pollfds(pollfds);
+#else
+	free(pollfds);
+#endif
+	return count;
+}
+
+static int libusb10_get_next_timeout(struct timeval *tv)
+{
+	return libusb_get_next_timeout(ctx, tv);
+}
+
+static void *libusb10_dev_mem_alloc(usb_dev_handle *udev, size_t size)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+	return libusb_dev_mem_alloc(udev->handle, size);
+#else
+	return NULL;
+#endif
+}
+
+static void libusb10_dev_mem_free(usb_dev_handle *udev, void *buffer, size_t size)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+	libusb_dev_mem_free(udev->handle, buffer, size);
+#endif
+}
+
+static const struct usbi_backend usbi_libusb10_backend = {
+	"libusb-1.0",
+	libusb10_init,
+	libusb10_exit,
+	find_busses,
+	find_all_devices,
+	libusb10_open,
+	libusb10_close,
+	libusb10_set_configuration,
+	libusb10_claim_interface,
+	libusb10_release_interface,
+	libusb10_set_interface_alt_setting,
+	libusb10_clear_halt,
+	libusb10_reset_device,
+	libusb10_kernel_driver_active,
+	libusb10_detach_kernel_driver,
+	libusb10_control_transfer,
+	libusb10_bulk_transfer,
+	libusb10_interrupt_transfer,
+	libusb10_get_string_descriptor_ascii,
+	libusb10_submit_transfer,
+	libusb10_cancel_transfer,
+	libusb10_lock_events,
+	libusb10_unlock_events,
+	libusb10_event_handling_ok,
+	libusb10_handle_events_locked,
+	libusb10_handle_events_completed,
+	libusb10_get_pollfds,
+	libusb10_get_next_timeout,
+	libusb10_dev_mem_alloc,
+	libusb10_dev_mem_free,
+};
+
+///////////////////////////////////////
+/* libusb0(M)ulti-platform Functions */
+///////////////////////////////////////
+
+#ifdef _MSC_VER
+
+/* Workaround for testing on windows via libusbX.*/
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME 1
+
+/*
+ * time between jan 1, 1601 and jan 1, 1970 in units of 100 nanoseconds
+ */
+#ifndef PTW32_TIMESPEC_TO_FILETIME_OFFSET
+#define PTW32_TIMESPEC_TO_FILETIME_OFFSET ( ((LONGLONG) 27111902 << 32) + (LONGLONG) 3577643008 )
+#endif
+
+static void filetime_to_timespec (const FILETIME * ft, struct timespec *ts)
+     /*
+      * -------------------------------------------------------------------
+      * converts FILETIME (as set by GetSystemTimeAsFileTime), where the time is
+      * expressed in 100 nanoseconds from Jan 1, 1601,
+      * into struct timespec
+      * where the time is expressed in seconds and nanoseconds from Jan 1, 1970.
+      * -------------------------------------------------------------------
+      */
+{
+  ts->tv_sec = (int) ((*(LONGLONG *) ft - PTW32_TIMESPEC_TO_FILETIME_OFFSET) / 10000000);
+  ts->tv_nsec = (int) ((*(LONGLONG *) ft - PTW32_TIMESPEC_TO_FILETIME_OFFSET - ((LONGLONG) ts->tv_sec * (LONGLONG) 10000000)) * 100);
+}
+
+static int clock_gettime(int clock_id, struct timespec * abstime)
+{
+  const int64_t NANOSEC_PER_MILLISEC = 1000000;
+  const int64_t MILLISEC_PER_SEC = 1000;
+  int64_t absMilliseconds;
+  FILETIME ft;
+
+  /* get current system time */
+  GetSystemTimeAsFileTime(&ft);
+  filetime_to_timespec(&ft, abstime);
+  absMilliseconds = (int64_t)abstime->tv_sec * MILLISEC_PER_SEC;
+  absMilliseconds += ((int64_t)abstime->tv_nsec + (NANOSEC_PER_MILLISEC/2)) / NANOSEC_PER_MILLISEC;
+
+  abstime->tv_nsec = (long)((absMilliseconds % 1000) * NANOSEC_PER_MILLISEC);
+  abstime->tv_sec = (long)(absMilliseconds / MILLISEC_PER_SEC);
+
+  return 0;
+}
+
+#endif
+#endif // _MSC_VER
+
+static void clock_add_rel_ms(int rel_ms, struct timespec * abstime)
+{
+  const int64_t NANOSEC_PER_MILLISEC = 1000000;
+  const int64_t MILLISEC_PER_SEC = 1000;
+  int64_t absMilliseconds;
+
+  absMilliseconds = rel_ms;
+  absMilliseconds += (int64_t)abstime->tv_sec * MILLISEC_PER_SEC;
+  absMilliseconds += ((int64_t)abstime->tv_nsec + (NANOSEC_PER_MILLISEC/2)) / NANOSEC_PER_MILLISEC;
+
+  abstime->tv_nsec = (long)((absMilliseconds % 1000) * NANOSEC_PER_MILLISEC);
+  abstime->tv_sec = (long)(absMilliseconds / MILLISEC_PER_SEC);
+}
+
+static int libusb_transfer_to_errno(int status)
+{
+	switch (status) {
+
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return ETIMEDOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return EIO;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return EOVERFLOW;
+	}
+
+	return EFAULT;
+}
+
+static MPL_THDPROC_RETURN_TYPE MPL_THDPROC_CC async_event_handler(void *arg) 
+{
+	struct timeval event_timeout_timeval;
+	int r;
+	int events_locked=0;
+
+	event_timeout_timeval.tv_sec  = ASYNC_TIMVAL_SEC;
+	event_timeout_timeval.tv_usec = 0;
+
+	if ((r=Mpl_Event_Wait(&async_thread.event_running, INFINITE)) != MPL_SUCCESS)
+	{
+		UD_ERR("Mpl_Event_Wait failed. ret=%d\n",r);
+		goto Done;
 	}
 
 	while (async_thread.is_run > 0) {
 
-		/* acquire the events lock */
-		if (events_locked == 0) {
-			libusb_lock_events(ctx);
-			events_locked = 1;
+		/* acquire the events lock */
+		if (events_locked == 0) {
+			backend->lock_events();
+			events_locked = 1;
+		}
+
+#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
+		if (!async_fly_pending()) {
+			backend->unlock_events();
+			events_locked=0;
+
+			/* submits set the event after counting themselves in if they
+			 * see idle, so one that comes in after the reset is either
+			 * seen by the second look or wakes the wait */
+			(void)MPL_Atomic_CmpExg32(&async_thread.idle, 1, 0);
+			Mpl_Event_Reset(&async_thread.event_running);
+			if (!async_fly_pending() && async_thread.is_run > 0)
+				Mpl_Event_Wait(&async_thread.event_running, ASYNC_TIMVAL_SEC * 1000);
+			async_thread.idle = 0;
+
+			continue;
+		}
+#endif
+		/*
+		checks that libusb is still happy for your thread to be performing event handling.
+		Sometimes, libusb needs to interrupt the event handler.
+		*/
+		if (!backend->event_handling_ok()) {
+			backend->unlock_events();
+			events_locked = 0;
+			continue;
+		}
+		r = backend->handle_events_locked(&event_timeout_timeval);
+	}
+	
+	if (events_locked)
+		backend->unlock_events();
+
+Done:
+	if ((r = Mpl_Event_Set(&async_thread.event_terminated)) != MPL_SUCCESS)
+	{
+		UD_ERR("Mpl_Event_Set failed. ret=%d\n", r);
+	}
+	UD_INFO("thread user-stopped\n");
+	return (MPL_THDPROC_RETURN_TYPE)NULL;
+}
+
+static void async_pool_destroy(usb_async_pool_t *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		libusb_free_transfer(pool->contexts[i].transfer);
+		Mpl_Event_Free(&pool->contexts[i].complete_event);
+	}
+	Mpl_Mutex_Free(&pool->lock);
+	free(pool->contexts);
+	free(pool);
+}
+
+/* detaches a pool from its handle. contexts still in use keep it alive */
+static void async_pool_close(usb_async_pool_t *pool)
+{
+	int destroy;
+
+	Mpl_Mutex_Wait(&pool->lock);
+	pool->closed = 1;
+	destroy = pool->outstanding == 0;
+	Mpl_Mutex_Release(&pool->lock);
+
+	if (destroy)
+		async_pool_destroy(pool);
+}
+
+static usb_async_transfer_t* async_pool_get(usb_async_pool_t *pool)
+{
+	usb_async_transfer_t* async_context;
+
+	Mpl_Mutex_Wait(&pool->lock);
+	if ((async_context = pool->free_list) != NULL) {
+		pool->free_list = async_context->next_free;
+		pool->outstanding++;
+	}
+	Mpl_Mutex_Release(&pool->lock);
+
+	return async_context;
+}
+
+static void async_pool_put(usb_async_transfer_t* async_context)
+{
+	usb_async_pool_t *pool = async_context->pool;
+	int destroy;
+
+	Mpl_Mutex_Wait(&pool->lock);
+	async_context->next_free = pool->free_list;
+	pool->free_list = async_context;
+	destroy = (--pool->outstanding == 0 && pool->closed);
+	Mpl_Mutex_Release(&pool->lock);
+
+	if (destroy)
+		async_pool_destroy(pool);
+}
+
+static void async_free(usb_async_transfer_t* async_context)
+{
+	if (async_context->queue)
+		MPL_Atomic_Dec32(&async_context->queue->attached);
+
+	stats_put(async_context->stats);
+	async_context->stats = NULL;
+	inflight_unlink(async_context);
+
+	if (async_context->pool) {
+		async_pool_put(async_context);
+		return;
+	}
+
+	libusb_free_transfer(async_context->transfer);
+	Mpl_Event_Free(&async_context->complete_event);
+	free(async_context);
+}
+
+/* The completion callback holds a pin while it sets complete_event, after
+ * its in-flight reference is gone. Pins count in the same word so that
+ * whoever drops the last of either frees the context, but they are not
+ * references: a woken reaper finds the context idle right away. */
+#define ASYNC_REF_PIN 0x10000
+
+static long async_refs(usb_async_transfer_t* async_context)
+{
+	return async_context->ref_count & (ASYNC_REF_PIN - 1);
+}
+
+/* drops the owner's reference; unlike async_dec_ref() this does not end an
+ * in-flight or reaping reference, so the in-flight count is left alone */
+static int async_release_ref(usb_async_transfer_t* async_context)
+{
+	int r = EAGAIN;
+	if ((r=MPL_Atomic_Dec32(&async_context->ref_count)) == 0)
+	{
+		async_free(async_context);
+		r = 0;
+	} else if (r < 0) {
+		UD_ERR("invalid transfer context; possible memory courruption\n");
+		return EACCES;
+	}
+	return r;
+}
+
+/* The in-flight count keeps the event thread awake while anything is in
+ * flight or being reaped. Each thread counts into its own shard, so
+ * threads driving different endpoints do not contend on one counter.
+ * Only the event thread sums the shards, when deciding to go idle.
+ *
+ * The sum is not a snapshot: a begin and its end may land on different
+ * shards and be seen out of order. Before the sum that lets it sleep, the
+ * event thread publishes idle, and every begin checks idle after counting
+ * itself in. A begin the sum missed came after idle was published, so it
+ * sees idle and sets event_running. */
+#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
+static ASYNC_THREAD_LOCAL int async_fly_shard = -1;
+
+static volatile long *async_fly_counter(void)
+{
+	if (async_fly_shard < 0)
+		async_fly_shard = (int)((MPL_Atomic_Inc32(&async_thread.fly_next_shard) - 1) % ASYNC_FLY_SHARDS);
+	return &async_thread.fly[async_fly_shard].count;
+}
+
+static int async_fly_pending(void)
+{
+	long count = 0;
+	int i;
+
+	for (i = 0; i < ASYNC_FLY_SHARDS; i++)
+		count += async_thread.fly[i].count;
+	return count != 0;
+}
+#endif
+
+static void async_fly_begin_many(long count)
+{
+#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
+	MPL_Atomic_Add32(async_fly_counter(), count);
+
+	/* setting the event costs a system call on some platforms */
+	if (async_thread.idle)
+		Mpl_Event_Set(&async_thread.event_running);
+#endif
+}
+
+static void async_fly_end_many(long count)
+{
+#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
+	MPL_Atomic_Add32(async_fly_counter(), -count);
+#endif
+}
+
+static void async_fly_begin(void)
+{
+	async_fly_begin_many(1);
+}
+
+static void async_fly_end(void)
+{
+	async_fly_end_many(1);
+}
+
+/* waits for a completion event. Without event threads the waiting thread
+ * handles events itself until the event is set. */
+static int async_wait_event(MPL_EVENT_T *event, int timeout)
+{
+	struct timeval tv;
+	muint64_t deadline = 0, now;
+	int r, wait;
+
+	if (!async_thread.external)
+		return Mpl_Event_Wait(event, timeout);
+
+	if (timeout > 0)
+		deadline = Mpl_Clock_Ticks_Ms() + timeout;
+
+	for (;;) {
+		if ((r = Mpl_Event_Wait(event, 0)) != MPL_TIMEOUT || timeout == 0)
+			return r;
+
+		wait = ASYNC_TIMVAL_SEC * 1000;
+		if (deadline) {
+			if ((now = Mpl_Clock_Ticks_Ms()) >= deadline)
+				return MPL_TIMEOUT;
+			if (deadline - now < (muint64_t)wait)
+				wait = (int)(deadline - now);
+		}
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		backend->handle_events_completed(&tv, NULL);
+	}
+}
+
+static int async_dec_ref(usb_async_transfer_t* async_context)
+{
+	int r = async_release_ref(async_context);
+
+	async_fly_end();
+	return r;
+}
+
+/* takes a reference without touching the in-flight count */
+static int async_take_ref(usb_async_transfer_t* async_context)
+{
+	int r;
+	if ((r=MPL_Atomic_Inc32(&async_context->ref_count)) < 1)
+	{
+		MPL_Atomic_Dec32(&async_context->ref_count);
+		UD_ERR("transfer is pending de-allocation\n");
+		return EACCES;
+	}
+	return 0;
+}
+
+static int async_inc_ref(usb_async_transfer_t* async_context) 
+{
+	int r = async_take_ref(async_context);
+
+	if (r == 0)
+		async_fly_begin();
+	return r;
+}
+
+static int async_stop_events(unsigned char wait_for_terminate) 
+{
+	Mpl_Mutex_Wait(&async_thread.init_mutex);
+	if (async_thread.is_run)
+	{
+		MPL_Atomic_Dec32(&async_thread.is_run);
+		Mpl_Event_Set(&async_thread.event_running);
+
+		Mpl_Event_Wait(&async_thread.event_terminated, INFINITE);
+
+		Mpl_Event_Reset(&async_thread.event_running);
+
+	}
+	Mpl_Mutex_Release(&async_thread.init_mutex);
+	return 0;
+}
+
+static int async_start_events(void) 
+{
+	int r = 0;
+	if (async_thread.is_run) return 0;
+
+	if ((r = MPL_Atomic_Inc32(&async_thread.is_run)) == 1)
+	{
+		Mpl_Mutex_Wait(&async_thread.init_mutex);
+
+		/* This thread will run in the background; create it 'detached'. */
+		r = Mpl_Thread_Init(&async_thread.handle, async_event_handler, &async_thread);
+		if (r == MPL_SUCCESS) {
+			/* the thread waits for event_running before it handles events,
+			 * so it is pinned before its first pass */
+			if (async_thread.cpu_mask &&
+				Mpl_Thread_SetAffinity(&async_thread.handle, async_thread.cpu_mask) != MPL_SUCCESS)
+				UD_WRN("failed pinning the event thread\n");
+
+			Mpl_Event_Set(&async_thread.event_running);
+			UD_INFO("thread started.\n");
+		} else {
+			MPL_Atomic_Dec32(&async_thread.is_run);
+			UD_ERR("Mpl_Thread_Init() failed. ret=%d\n",r);
+		}
+
+		Mpl_Mutex_Release(&async_thread.init_mutex);
+
+	} else {
+		MPL_Atomic_Dec32(&async_thread.is_run);
+		r=0;
+	}
+
+	return r;
+}
+
+/* makes the notification fd of a queue readable, once per reap */
+static void async_queue_notify(usb_async_queue_t* queue)
+{
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+	if (queue->notify_fd[1] >= 0 && MPL_Atomic_CmpExg32(&queue->notify_pending, 1, 0)) {
+#ifdef __linux__
+		uint64_t one = 1;
+		if (write(queue->notify_fd[1], &one, sizeof(one)) < 0)
+#else
+		if (write(queue->notify_fd[1], "", 1) < 0)
+#endif
+			UD_ERR("failed writing completion queue fd. errno=%d\n", errno);
+	}
+#endif
+}
+
+/* empties the notification fd of a queue before it is reaped */
+static void async_queue_drain(usb_async_queue_t* queue)
+{
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+	char buf[64];
+
+	/* read before clearing notify_pending, or the write of a callback
+	 * that sets it in between could be swallowed */
+	if (queue->notify_pending) {
+		while (read(queue->notify_fd[0], buf, sizeof(buf)) == sizeof(buf))
+			;
+		(void)MPL_Atomic_CmpExg32(&queue->notify_pending, 0, 1);
+	}
+#endif
+}
+
+/* publishes a completed context to its queue. the context keeps the
+ * in-flight reference until it is reaped. */
+static void async_queue_push(usb_async_queue_t* queue, usb_async_transfer_t* async_context)
+{
+	long slot = (MPL_Atomic_Inc32(&queue->head) - 1) & queue->mask;
+
+	if (!MPL_Atomic_CmpExgPtr(&queue->slots[slot], async_context, NULL))
+		UD_ERR("completion queue overflow\n");
+
+	if (queue->waiting && MPL_Atomic_CmpExg32(&queue->waiting, 0, 1))
+		Mpl_Event_Set(&queue->event);
+	async_queue_notify(queue);
+}
+
+/* returns the transfer length or a negative errno for a completed context */
+static int async_result(usb_async_transfer_t* async_context)
+{
+	int r = libusb_transfer_to_errno(async_context->transfer->status);
+
+	if (r==0 || (r == ETIMEDOUT && async_context->transfer->actual_length > 0))
+		return async_context->transfer->actual_length;
+	return -r;
+}
+
+/* libusb-1.0 leaves actual_length of isochronous transfers at 0; set it to
+ * the sum of the packet lengths, packing the payloads first in compact mode */
+static void async_iso_complete(usb_async_transfer_t* async_context)
+{
+	struct libusb_transfer *transfer = async_context->transfer;
+	int offset = 0;
+	int length = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+		if (desc->status == LIBUSB_TRANSFER_COMPLETED) {
+			if (async_context->iso_compact && offset != length && desc->actual_length)
+				memmove(transfer->buffer + length, transfer->buffer + offset,
+					desc->actual_length);
+			length += desc->actual_length;
+		}
+		offset += desc->length;
+	}
+	transfer->actual_length = length;
+}
+
+/* records the completion-to-reap time of a context */
+static void async_stats_reaped(usb_async_transfer_t* async_context)
+{
+	if (async_context->stats)
+		stats_reap(async_context->stats, async_context->transfer->endpoint,
+			Mpl_Clock_Ticks_Us() - async_context->complete_us);
+}
+
+/* hands a completion to the context callback and resubmits the transfer
+ * in auto-resubmit mode */
+static void async_callback(usb_async_transfer_t* async_context)
+{
+	struct libusb_transfer *transfer = async_context->transfer;
+	int result = async_result(async_context);
+	int r;
+
+	if (!async_context->resubmit) {
+		usb_async_callback callback = async_context->callback;
+		void *callback_data = async_context->callback_data;
+
+		/* drop the in-flight reference first so the callback can submit
+		 * again; if it was the last one the owner has freed the context.
+		 * The context is not touched after that. */
+		if (async_dec_ref(async_context) == 0)
+			return;
+		callback(async_context, result, callback_data);
+		return;
+	}
+
+	/* the owner freed the context without cancelling it */
+	if (async_refs(async_context) == 1) {
+		async_dec_ref(async_context);
+		return;
+	}
+
+	if (!async_context->callback(async_context, result, async_context->callback_data) &&
+		transfer->status == LIBUSB_TRANSFER_COMPLETED && !async_context->cancelled) {
+		transfer->status = LIBUSB_TRANSFER_ERROR;
+		transfer->actual_length = 0;
+		if (async_context->stats)
+			async_context->submit_us = Mpl_Clock_Ticks_Us();
+		inflight_begin(async_context);
+		if ((r = backend->submit_transfer(transfer)) == LIBUSB_SUCCESS) {
+			/* a cancel that came in while the transfer was not in flight */
+			if (async_context->cancelled)
+				backend->cancel_transfer(transfer);
+			return;
+		}
+		inflight_abort(async_context);
+		UD_ERR("auto-resubmit failed. ret=%d\n", r);
+	}
+	async_dec_ref(async_context);
+}
+
+/* libusb-1.0 callback proc for all asynchronous bulk and interrupt transfers */
+#ifdef _WIN32
+static void LIBUSB_CALL async_bulk_cb(struct libusb_transfer *transfer)
+#else
+static void async_bulk_cb(struct libusb_transfer *transfer)
+#endif
+{
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)transfer->user_data;
+	struct usbi_inflight *inflight = async_context->inflight;
+	unsigned char endpoint = transfer->endpoint;
+
+	async_context->submitted = 0;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		async_iso_complete(async_context);
+
+	if (async_context->stats) {
+		async_context->complete_us = Mpl_Clock_Ticks_Us();
+		stats_complete(async_context->stats, transfer->endpoint,
+			async_context->complete_us - async_context->submit_us,
+			async_result(async_context),
+			transfer->status == LIBUSB_TRANSFER_CANCELLED);
+	}
+
+	/* the transfer stays counted until it is handed back, so that
+	 * usb_cancel_endpoint() does not return before that. The context may
+	 * be gone afterwards; hold on to the in-flight block instead. */
+	MPL_Atomic_Inc32(&inflight->ref_count);
+
+	if (async_context->callback) {
+		async_callback(async_context);
+	} else if (async_context->queue) {
+		async_queue_push(async_context->queue, async_context);
+	} else {
+		/* trade the in-flight reference for a pin, so that a woken
+		 * reaper can submit again while the event is still being set */
+		MPL_Atomic_Add32(&async_context->ref_count, ASYNC_REF_PIN - 1);
+		async_fly_end();
+
+		/* signal the complete event */
+		Mpl_Event_Set(&async_context->complete_event);
+
+		if (MPL_Atomic_Add32(&async_context->ref_count, -ASYNC_REF_PIN) == 0)
+			async_free(async_context);
+	}
+
+	inflight_end(inflight, endpoint);
+	inflight_put(inflight);
+}
+
+/* validates an idle context and sets up its transfer for a submit. takes
+ * the in-flight reference but leaves the in-flight count to the caller. */
+static int async_prepare(usb_async_transfer_t *async_context, char *bytes, int size, unsigned int timeout)
+{
+	int r;
+	if (!async_context || (!bytes && size > 0) || async_refs(async_context) != 1) return -(errno=EINVAL);
+
+	/* control transfers start with the setup packet; its wLength must fit
+	 * in the rest of the buffer */
+	if (async_context->transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL &&
+		(size < LIBUSB_CONTROL_SETUP_SIZE ||
+		 USB_LE16_TO_CPU(((struct libusb_control_setup*)bytes)->wLength) > size - LIBUSB_CONTROL_SETUP_SIZE))
+		return -(errno=EINVAL);
+
+	if (async_context->legacy_iso_pktsize && async_context->transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		int num_packets = size / async_context->legacy_iso_pktsize;
+		int ipacket;
+		if (num_packets==0 || num_packets > async_context->max_iso_packets) {
+			UD_ERR("invalid number of iso packets. num_packets=%d\n",num_packets);
+			 return -(errno=EINVAL);
+		}
+
+		async_context->transfer->num_iso_packets = num_packets;
+		for (ipacket=0; ipacket < num_packets; ipacket++)
+			async_context->transfer->iso_packet_desc[ipacket].length=async_context->legacy_iso_pktsize;
+	}
+
+	r = async_take_ref(async_context);
+	if (r != 0) return -(errno=r);
+
+	async_context->transfer->buffer			= (unsigned char*)&bytes[0];
+	async_context->transfer->length			= size;
+	async_context->transfer->status			= LIBUSB_TRANSFER_ERROR;
+	async_context->transfer->actual_length	= 0;
+	async_context->transfer->timeout		= timeout;
+	async_context->cancelled				= 0;
+
+	if (!async_context->queue && !async_context->callback)
+		Mpl_Event_Reset(&async_context->complete_event);
+
+	if (async_context->stats)
+		async_context->submit_us = Mpl_Clock_Ticks_Us();
+	return 0;
+}
+
+static int async_submit(void *context, char *bytes, int size, unsigned int timeout)
+{
+	int r;
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+
+	if ((r = async_prepare(async_context, bytes, size, timeout)) != 0)
+		return r;
+
+	async_fly_begin();
+	inflight_begin(async_context);
+	r = backend->submit_transfer(async_context->transfer);
+	if (r != LIBUSB_SUCCESS) {
+
+		inflight_abort(async_context);
+		async_dec_ref(async_context);
+		return compat_err(r);
+	}
+
+	return 0;
+}
+
+static int async_reap(void *context, int timeout, int cancel_on_timeout)
+{
+	int r=0;
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+	if (!async_context || async_refs(async_context) < 1) return -(errno=EINVAL);
+
+	/* completions of queued contexts are reaped with usb_reap_async_many(),
+	 * those of contexts with a callback are not reaped at all */
+	if (async_context->queue || async_context->callback) return -(errno=EINVAL);
+
+	if (async_inc_ref(async_context) != 0)
+	{
+		UD_ERR("transfer is pending de-allocation\n");
+		return  -(errno=EACCES);
+	}
+reap_retry_for_cancel:
+	r = async_wait_event(&async_context->complete_event, timeout);
+	if (r == ETIMEDOUT && cancel_on_timeout) {
+		usb_cancel_async(context);
+		cancel_on_timeout = 0;
+		timeout = -1;
+		goto reap_retry_for_cancel;
+	}
+
+	if (r == MPL_SUCCESS) {
+
+		r = async_result(async_context);
+		async_stats_reaped(async_context);
+		async_dec_ref(async_context);
+		if (r < 0) errno = -r;
+		return r;
+	}
+
+	async_dec_ref(async_context);
+	return -(errno=r);
+}
+
+/* pops up to max completions; only the reaping thread may call this */
+static int async_queue_pop(usb_async_queue_t* queue, struct usb_async_completion* completions, int max)
+{
+	usb_async_transfer_t* async_context;
+	int count = 0;
+
+	while (count < max) {
+		async_context = queue->slots[queue->tail & queue->mask];
+		if (!async_context)
+			break;
+
+		queue->slots[queue->tail & queue->mask] = NULL;
+		queue->tail++;
+
+		/* usb_free_async() already dropped the owner's reference; the
+		 * completion is not reported and the last reference frees it */
+		if (async_refs(async_context) == 1) {
+			async_dec_ref(async_context);
+			continue;
+		}
+
+		completions[count].context = async_context;
+		completions[count].result = async_result(async_context);
+		async_stats_reaped(async_context);
+		count++;
+
+		/* drop the in-flight reference the callback left behind */
+		async_dec_ref(async_context);
+	}
+	return count;
+}
+
+static int usb_setup_async(usb_dev_handle *dev, void **context, unsigned char transfer_type, unsigned char ep, int num_iso_packets)
+{
+	usb_async_transfer_t *async_context = NULL;
+	usb_async_pool_t *pool = dev->async_pool;
+	int r;
+
+	/* iso contexts come from the pool only if it was sized for them */
+	if (pool && (transfer_type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || pool->max_iso_packets))
+		async_context = async_pool_get(pool);
+
+	if (async_context) {
+		async_context->legacy_iso_pktsize = 0;
+		async_context->iso_compact = 0;
+		async_context->queue = NULL;
+		async_context->callback = NULL;
+		async_context->resubmit = 0;
+		async_context->transfer->flags = 0;
+		async_context->transfer->num_iso_packets =
+			(transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? async_context->max_iso_packets : 0;
+		Mpl_Event_Reset(&async_context->complete_event);
+	} else {
+		async_context = malloc(sizeof(usb_async_transfer_t));
+		if (!async_context) return -(errno=ENOMEM);
+		memset(async_context,0,sizeof(usb_async_transfer_t));
+
+		async_context->transfer	= libusb_alloc_transfer(num_iso_packets);
+		if (!async_context->transfer) {
+			free(async_context);
+			return -(errno=ENOMEM);
+		}
+
+		if ((r = Mpl_Event_Init(&async_context->complete_event,0,0)) != MPL_SUCCESS) {
+			libusb_free_transfer(async_context->transfer);
+			free(async_context);
+			return -(errno=r);
+		}
+		async_context->max_iso_packets = num_iso_packets;
+		async_context->transfer->num_iso_packets = num_iso_packets;
+	}
+
+	async_context->dev = dev;
+	async_context->stats = stats_get(dev->stats);
+	inflight_link(dev->inflight, async_context);
+	async_context->ref_count = 1;
+	async_context->transfer->callback = async_bulk_cb;
+	async_context->transfer->dev_handle = dev->handle;
+	async_context->transfer->endpoint = ep;
+	async_context->transfer->timeout = 0;
+	async_context->transfer->type = transfer_type;
+	async_context->transfer->status = LIBUSB_TRANSFER_ERROR;
+	async_context->transfer->user_data = async_context;
+
+	*context = async_context;
+
+	return LIBUSB_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////
+/* libusb0(M)ulti-platform libusb-win32 async compatiblity layer */
+///////////////////////////////////////////////////////////////////
+
+API_EXPORTED int USBAPI_DECL usb_bulk_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
+{
+	return usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_BULK, ep, 0);
+}
+
+API_EXPORTED int USBAPI_DECL usb_interrupt_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
+{
+	return usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_INTERRUPT, ep, 0);
+}
+
+API_EXPORTED int USBAPI_DECL usb_control_setup_async(usb_dev_handle *dev, void **context)
+{
+	return usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_CONTROL, 0, 0);
+}
+
+API_EXPORTED int USBAPI_DECL usb_control_fill_setup(char *bytes, int requesttype, int request, int value, int index, int size)
+{
+	if (!bytes || size < 0 || size > 0xffff) return -(errno=EINVAL);
+
+	libusb_fill_control_setup((unsigned char*)bytes, (uint8_t)requesttype,
+		(uint8_t)request, (uint16_t)value, (uint16_t)index, (uint16_t)size);
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_isochronous_setup_async(usb_dev_handle *dev, void **context, unsigned char ep, int pktsize)
+{
+	int r;
+	if ((r = usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, ep, 1024)) == 0)
+	{
+		usb_async_transfer_t *async_context = (usb_async_transfer_t*)*context;
+		async_context->legacy_iso_pktsize = pktsize;
+	}
+	return r;
+}
+
+API_EXPORTED int USBAPI_DECL usb_setup_async_pool(usb_dev_handle *dev, int count, int max_iso_packets)
+{
+	usb_async_pool_t *pool;
+	int i, r;
+
+	if (!dev || count < 1 || max_iso_packets < 0 || max_iso_packets > 1024)
+		return -(errno=EINVAL);
+	if (dev->async_pool) return -(errno=EBUSY);
+
+	pool = malloc(sizeof(usb_async_pool_t));
+	if (!pool) return -(errno=ENOMEM);
+	memset(pool,0,sizeof(usb_async_pool_t));
+
+	pool->contexts = calloc(count, sizeof(usb_async_transfer_t));
+	if (!pool->contexts) {
+		free(pool);
+		return -(errno=ENOMEM);
+	}
+	pool->max_iso_packets = max_iso_packets;
+
+	if ((r = Mpl_Mutex_Init(&pool->lock)) != MPL_SUCCESS) {
+		free(pool->contexts);
+		free(pool);
+		return -(errno=r);
+	}
+
+	for (i = 0; i < count; i++) {
+		usb_async_transfer_t *async_context = &pool->contexts[i];
+
+		async_context->transfer = libusb_alloc_transfer(max_iso_packets);
+		if (!async_context->transfer) {
+			async_pool_destroy(pool);
+			return -(errno=ENOMEM);
+		}
+		if ((r = Mpl_Event_Init(&async_context->complete_event,0,0)) != MPL_SUCCESS) {
+			libusb_free_transfer(async_context->transfer);
+			async_pool_destroy(pool);
+			return -(errno=r);
+		}
+		pool->count++;
+
+		async_context->max_iso_packets = max_iso_packets;
+		async_context->pool = pool;
+		async_context->next_free = pool->free_list;
+		pool->free_list = async_context;
+	}
+
+	dev->async_pool = pool;
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_isochronous_set_compact(void *context, int enable)
+{
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+	if (!async_context || async_context->transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) return -(errno=EINVAL);
+	if (async_refs(async_context) != 1) return -(errno=EBUSY);
+	/* packing would move the caller's OUT data around */
+	if (enable && !(async_context->transfer->endpoint & USB_ENDPOINT_IN)) return -(errno=EINVAL);
+
+	async_context->iso_compact = enable ? 1 : 0;
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_isochronous_get_results(void *context, struct usb_iso_packet_result *results, int max)
+{
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+	struct libusb_transfer *transfer;
+	int offset = 0;
+	int i;
+
+	if (!async_context || (!results && max > 0)) return -(errno=EINVAL);
+	transfer = async_context->transfer;
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) return -(errno=EINVAL);
+	if (async_refs(async_context) != 1) return -(errno=EBUSY);
+
+	for (i = 0; i < transfer->num_iso_packets && i < max; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+		int valid = desc->status == LIBUSB_TRANSFER_COMPLETED;
+
+		results[i].offset = offset;
+		results[i].length = valid ? (int)desc->actual_length : 0;
+		results[i].status = -libusb_transfer_to_errno(desc->status);
+
+		/* compacted payloads follow each other; otherwise each packet
+		 * starts where the previous packet's slot ends */
+		offset += async_context->iso_compact ? results[i].length : (int)desc->length;
+	}
+	return transfer->num_iso_packets;
+}
+
+API_EXPORTED int USBAPI_DECL usb_submit_async(void *context, char *bytes, int size)
+{
+	return async_submit(context, bytes, size, 0);
+}
+
+API_EXPORTED int USBAPI_DECL usb_submit_async_timeout(void *context, char *bytes, int size, int timeout)
+{
+	if (timeout < 0) return -(errno=EINVAL);
+
+	/* the backend keeps its in-flight transfers ordered by deadline and
+	 * completes expired ones as TIMED_OUT with their actual_length */
+	return async_submit(context, bytes, size, (unsigned int)timeout);
+}
+
+API_EXPORTED int USBAPI_DECL usb_submit_async_many(struct usb_async_submission *submissions, int count)
+{
+	int i, prepared = 0, failed = 0, r;
+
+	if (!submissions || count < 1) return -(errno=EINVAL);
+
+	for (i = 0; i < count; i++) {
+		struct usb_async_submission *sub = &submissions[i];
+
+		sub->result = async_prepare((usb_async_transfer_t*)sub->context,
+			sub->bytes, sub->size, 0);
+		if (sub->result == 0)
+			prepared++;
+	}
+	if (!prepared)
+		return 0;
+
+	/* account for the whole batch at once; this wakes the event threads
+	 * at most once */
+	async_fly_begin_many(prepared);
+
+	for (i = 0; i < count; i++) {
+		struct usb_async_submission *sub = &submissions[i];
+
+		if (sub->result != 0)
+			continue;
+		inflight_begin((usb_async_transfer_t*)sub->context);
+		if ((r = backend->submit_transfer(((usb_async_transfer_t*)sub->context)->transfer)) != LIBUSB_SUCCESS) {
+			inflight_abort((usb_async_transfer_t*)sub->context);
+			async_release_ref((usb_async_transfer_t*)sub->context);
+			sub->result = -libusb_to_errno(r);
+			failed++;
+		}
+	}
+	if (failed)
+		async_fly_end_many(failed);
+
+	return prepared - failed;
+}
+
+API_EXPORTED int USBAPI_DECL usb_reap_async(void *context, int timeout)
+{
+	return async_reap(context,timeout, 1);
+}
+
+API_EXPORTED int USBAPI_DECL usb_reap_async_nocancel(void *context, int timeout)
+{
+	return async_reap(context,timeout, 0);
+}
+
+API_EXPORTED int USBAPI_DECL usb_cancel_async(void *context)
+{
+	int r;
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+	if (!async_context) return -(errno=EINVAL);
+
+	if (async_refs(async_context) > 1) {
+		async_context->cancelled = 1;
+		r = backend->cancel_transfer(async_context->transfer);
+		if (r != 0) return compat_err(r);
+	}
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_cancel_endpoint(usb_dev_handle *dev, int ep)
+{
+	struct usbi_inflight *inflight;
+	usb_async_transfer_t *async_context;
+	int i, pending;
+
+	if (!dev) return -(errno=EINVAL);
+	inflight = dev->inflight;
+
+	Mpl_Mutex_Wait(&inflight->lock);
+	for (async_context = inflight->contexts; async_context; async_context = async_context->inflight_next) {
+		if (!async_context->submitted ||
+			(ep >= 0 && async_context->transfer->endpoint != (unsigned char)ep))
+			continue;
+		/* contexts freed by their owner while in flight are still
+		 * listed and cancelled too */
+		async_context->cancelled = 1;
+		backend->cancel_transfer(async_context->transfer);
+	}
+	Mpl_Mutex_Release(&inflight->lock);
+
+	/* wait once for all of them; drained is set by whichever completion
+	 * empties an endpoint, so check the counts again after each wakeup */
+	for (;;) {
+		Mpl_Event_Reset(&inflight->drained);
+		pending = 0;
+		for (i = 0; i < STATS_EP_COUNT; i++) {
+			if (ep < 0 || i == STATS_EP_INDEX(ep))
+				pending += inflight->count[i];
+		}
+		if (!pending)
+			return 0;
+		async_wait_event(&inflight->drained, ASYNC_DRAIN_POLL_MS);
+	}
+}
+
+API_EXPORTED int USBAPI_DECL usb_free_async(void **context)
+{
+	int r;
+	usb_async_transfer_t *async_context;
+	if (!context || !*context) return -(errno=EINVAL);
+	async_context = (usb_async_transfer_t*)*context;
+	*context = NULL;
+	r = async_release_ref(async_context);
+	if (r!=0) return -(errno=r);
+
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_async_set_callback(void *context, usb_async_callback callback, void *user_data, int flags)
+{
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+	if (!async_context || (flags & ~USB_ASYNC_RESUBMIT)) return -(errno=EINVAL);
+
+	/* only idle contexts can change their completion mode */
+	if (async_refs(async_context) != 1) return -(errno=EBUSY);
+
+	async_context->callback = callback;
+	async_context->callback_data = user_data;
+	async_context->resubmit = callback && (flags & USB_ASYNC_RESUBMIT);
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_async_queue_create(void **queue, int size)
+{
+	usb_async_queue_t *async_queue;
+	long slots = 1;
+	int r;
+
+	if (!queue || size < 1) return -(errno=EINVAL);
+
+	while (slots < size)
+		slots <<= 1;
+
+	async_queue = malloc(sizeof(usb_async_queue_t));
+	if (!async_queue) return -(errno=ENOMEM);
+	memset(async_queue,0,sizeof(usb_async_queue_t));
+
+	async_queue->slots = calloc(slots, sizeof(usb_async_transfer_t*));
+	if (!async_queue->slots) {
+		free(async_queue);
+		return -(errno=ENOMEM);
+	}
+	async_queue->mask = slots - 1;
+	async_queue->notify_fd[0] = async_queue->notify_fd[1] = -1;
+
+	if ((r = Mpl_Event_Init(&async_queue->event,1,0)) != MPL_SUCCESS) {
+		free((void*)async_queue->slots);
+		free(async_queue);
+		return -(errno=r);
+	}
+
+	*queue = async_queue;
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_async_queue_free(void **queue)
+{
+	usb_async_queue_t *async_queue;
+	if (!queue || !*queue) return -(errno=EINVAL);
+	async_queue = (usb_async_queue_t*)*queue;
+
+	/* attached contexts must be freed first; unreaped completions keep
+	 * their context alive */
+	if (async_queue->attached) return -(errno=EBUSY);
+
+	*queue = NULL;
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+	if (async_queue->notify_fd[0] >= 0)
+		close(async_queue->notify_fd[0]);
+	if (async_queue->notify_fd[1] >= 0 && async_queue->notify_fd[1] != async_queue->notify_fd[0])
+		close(async_queue->notify_fd[1]);
+#endif
+	Mpl_Event_Free(&async_queue->event);
+	free((void*)async_queue->slots);
+	free(async_queue);
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_async_queue_attach(void *context, void *queue)
+{
+	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
+	usb_async_queue_t *async_queue = (usb_async_queue_t*)queue;
+	if (!async_context) return -(errno=EINVAL);
+
+	/* only idle contexts can move between queues */
+	if (async_refs(async_context) != 1) return -(errno=EBUSY);
+
+	if (async_queue) {
+		if (MPL_Atomic_Inc32(&async_queue->attached) > async_queue->mask + 1) {
+			MPL_Atomic_Dec32(&async_queue->attached);
+			return -(errno=ENOSPC);
+		}
+	}
+	if (async_context->queue)
+		MPL_Atomic_Dec32(&async_context->queue->attached);
+
+	async_context->queue = async_queue;
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_reap_async_many(void *queue, struct usb_async_completion *completions, int max, int timeout)
+{
+	usb_async_queue_t *async_queue = (usb_async_queue_t*)queue;
+	muint64_t deadline = 0;
+	int count, r;
+
+	if (!async_queue || !completions || max < 1) return -(errno=EINVAL);
+
+	if (timeout > 0)
+		deadline = Mpl_Clock_Ticks_Ms() + timeout;
+
+	for (;;) {
+		async_queue_drain(async_queue);
+		if ((count = async_queue_pop(async_queue, completions, max)) > 0) {
+			/* there may be more; keep the fd readable */
+			if (count == max)
+				async_queue_notify(async_queue);
+			return count;
+		}
+
+		if (timeout == 0)
+			return -(errno=ETIMEDOUT);
+		if (timeout > 0) {
+			muint64_t now = Mpl_Clock_Ticks_Ms();
+			if (now >= deadline)
+				return -(errno=ETIMEDOUT);
+			timeout = (int)(deadline - now);
+		}
+
+		/* announce the wait, then look once more so a completion pushed in
+		 * between is not missed */
+		(void)MPL_Atomic_CmpExg32(&async_queue->waiting, 1, 0);
+		count = async_queue_pop(async_queue, completions, max);
+		r = count ? MPL_SUCCESS : async_wait_event(&async_queue->event, timeout);
+		(void)MPL_Atomic_CmpExg32(&async_queue->waiting, 0, 1);
+
+		if (count > 0)
+			return count;
+		if (r != MPL_SUCCESS && r != ETIMEDOUT)
+			return -(errno=r);
+	}
+}
+
+API_EXPORTED int USBAPI_DECL usb_async_queue_get_fd(void *queue)
+{
+	usb_async_queue_t *async_queue = (usb_async_queue_t*)queue;
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+	int fds[2];
+
+	if (!async_queue) return -(errno=EINVAL);
+	if (async_queue->notify_fd[0] >= 0)
+		return async_queue->notify_fd[0];
+
+#ifdef __linux__
+	fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[0] < 0)
+#endif
+	{
+		if (pipe(fds) < 0)
+			return -errno;
+		fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	}
+
+	/* completions may already be queued; callbacks pick up the write end
+	 * once it is set */
+	async_queue->notify_fd[0] = fds[0];
+	async_queue->notify_fd[1] = fds[1];
+	async_queue_notify(async_queue);
+	return fds[0];
+#else
+	if (!async_queue) return -(errno=EINVAL);
+	return -(errno=ENOSYS);
+#endif
+}
+
+API_EXPORTED int USBAPI_DECL usb_get_pollfds(struct usb_pollfd *fds, int max)
+{
+	int r;
+
+	if ((!fds && max) || max < 0) return -(errno=EINVAL);
+
+	r = backend->get_pollfds(fds, max);
+	return r < 0 ? compat_err(r) : r;
+}
+
+API_EXPORTED int USBAPI_DECL usb_get_next_timeout(int *timeout)
+{
+	struct timeval tv;
+	int r;
+
+	if (!timeout) return -(errno=EINVAL);
+
+	r = backend->get_next_timeout(&tv);
+	if (r < 0)
+		return compat_err(r);
+
+	/* round up so a poll() with this timeout does not wake up early */
+	*timeout = r ? (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000) : -1;
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_handle_events(void)
+{
+	struct timeval tv;
+	int r;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	r = backend->handle_events_completed(&tv, NULL);
+	return r < 0 ? compat_err(r) : 0;
+}
+
+///////////////////////////////////////
+/* vectored bulk I/O                 */
+///////////////////////////////////////
+
+/*
+ * A vectored transfer is split into pieces that each go out as their own
+ * libusb transfer. Segment boundaries that do not fall on a packet boundary
+ * would end the transfer with a short packet, so the bytes around such a
+ * seam are moved through a small bounce buffer instead. Everything else is
+ * transferred straight from/to the caller's buffers.
+ */
+
+/* calls with up to this many segments keep their pieces on the stack */
+#define BULKV_STACK_SEGMENTS	(4)
+#define BULKV_STACK_MPS			(1024)
+/* most OUT pieces in flight at once; each one has its own transfer */
+#define BULKV_DEPTH				(8)
+
+struct bulkv_piece {
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;	/* caller memory or a bounce buffer */
+	int offset;				/* offset of the piece in the whole transfer */
+	int length;
+	int bounce;
+	volatile int done;
+	int *completed;
+};
+
+/* copies between the iovecs (from 'offset' on) and buf */
+static void bulkv_copy(const struct usb_iovec *iov, int iovcnt, int offset,
+	unsigned char *buf, int length, int to_iov)
+{
+	int i, n;
+
+	for (i = 0; i < iovcnt && length > 0; i++) {
+		if (offset >= (int)iov[i].iov_len) {
+			offset -= (int)iov[i].iov_len;
+			continue;
+		}
+		n = (int)iov[i].iov_len - offset;
+		if (n > length)
+			n = length;
+		if (to_iov)
+			memcpy((unsigned char *)iov[i].iov_base + offset, buf, n);
+		else
+			memcpy(buf, (unsigned char *)iov[i].iov_base + offset, n);
+		buf += n;
+		length -= n;
+		offset = 0;
+	}
+}
+
+/* fills pieces; returns the piece count. pieces must hold 2 * iovcnt entries
+ * and bounce iovcnt * mps bytes */
+static int bulkv_split(const struct usb_iovec *iov, int iovcnt, int mps,
+	struct bulkv_piece *pieces, unsigned char *bounce)
+{
+	int count = 0;
+	int pos = 0;
+	int seam_offset = 0, seam_length = 0;
+	int i, k, rest, direct;
+
+	for (i = 0; i < iovcnt; i++) {
+		int len = (int)iov[i].iov_len;
+		int o = 0;
+
+		if (seam_length > 0) {
+			/* top the open seam up to a full packet */
+			k = mps - seam_length < len ? mps - seam_length : len;
+			seam_length += k;
+			o = k;
+			if (seam_length < mps && i < iovcnt - 1) {
+				pos += len;
+				continue;
+			}
+			pieces[count].buffer = bounce;
+			pieces[count].offset = seam_offset;
+			pieces[count].length = seam_length;
+			pieces[count++].bounce = 1;
+			bounce += mps;
+			seam_length = 0;
+		}
+
+		rest = len - o;
+		direct = i == iovcnt - 1 ? rest : rest - (rest % mps);
+		if (direct > 0) {
+			pieces[count].buffer = (unsigned char *)iov[i].iov_base + o;
+			pieces[count].offset = pos + o;
+			pieces[count].length = direct;
+			pieces[count++].bounce = 0;
+		}
+		if (rest > direct) {
+			seam_offset = pos + o + direct;
+			seam_length = rest - direct;
+		}
+		pos += len;
+	}
+
+	if (seam_length > 0) {
+		pieces[count].buffer = bounce;
+		pieces[count].offset = seam_offset;
+		pieces[count].length = seam_length;
+		pieces[count++].bounce = 1;
+	}
+	return count;
+}
+
+#ifdef _WIN32
+static void LIBUSB_CALL bulkv_cb(struct libusb_transfer *transfer)
+#else
+static void bulkv_cb(struct libusb_transfer *transfer)
+#endif
+{
+	struct bulkv_piece *piece = (struct bulkv_piece *)transfer->user_data;
+
+	piece->done = 1;
+	*piece->completed = 1;
+}
+
+static int usbi_max_packet_size(usb_dev_handle *dev, int ep)
+{
+	struct usb_device *udev = dev->device;
+	int c, i, a, e;
+
+	for (c = 0; c < udev->descriptor.bNumConfigurations && udev->config; c++) {
+		struct usb_config_descriptor *config = &udev->config[c];
+		for (i = 0; i < config->bNumInterfaces; i++) {
+			struct usb_interface *iface = &config->interface[i];
+			for (a = 0; a < iface->num_altsetting; a++) {
+				struct usb_interface_descriptor *alt = &iface->altsetting[a];
+				for (e = 0; e < alt->bNumEndpoints; e++) {
+					if (alt->endpoint[e].bEndpointAddress == ep)
+						return alt->endpoint[e].wMaxPacketSize & 0x7ff;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * OUT pieces go BULKV_DEPTH at a time. IN pieces go one at a time: a short
+ * packet ends the transfer, and a piece already queued behind it would read
+ * the start of the next one. The pieces in flight share depth transfers.
+ * timeout covers the whole call; each piece gets what is left of it.
+ */
+static int usb_bulk_iov(usb_dev_handle *dev, int ep, const struct usb_iovec *iov,
+	int iovcnt, int timeout)
+{
+	struct bulkv_piece stack_pieces[2 * BULKV_STACK_SEGMENTS];
+	unsigned char stack_bounce[BULKV_STACK_SEGMENTS * BULKV_STACK_MPS];
+	struct libusb_transfer *transfers[BULKV_DEPTH];
+	struct bulkv_piece *pieces;
+	unsigned char *bounce;
+	struct timeval tv;
+	int is_in = ep & USB_ENDPOINT_IN;
+	int count, depth, submitted = 0, finished = 0;
+	int completed = 0, stop = 0, cancelled = 0, expired = 0;
+	int total = 0, mps, i;
+	int r = 0;		/* libusb-1.0 error of a failed submit */
+	int err = 0;	/* errno of a failed piece */
+	muint64_t start, deadline = 0, now;
+
+	if (!dev || !iov || iovcnt < 1) return -(errno=EINVAL);
+	for (i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_base && iov[i].iov_len) return -(errno=EINVAL);
+	}
+	if ((mps = usbi_max_packet_size(dev, ep)) <= 0) return -(errno=EINVAL);
+
+	/* Travis: Fixed */
+	if (errno==ETIMEDOUT) errno=0;
+
+	if (iovcnt <= BULKV_STACK_SEGMENTS && mps <= BULKV_STACK_MPS) {
+		pieces = stack_pieces;
+		bounce = stack_bounce;
+	} else {
+		pieces = malloc((sizeof(*pieces) * 2 * iovcnt) + (mps * iovcnt));
+		if (!pieces) return -(errno=ENOMEM);
+		bounce = (unsigned char *)(pieces + (2 * iovcnt));
+	}
+	memset(pieces, 0, sizeof(*pieces) * 2 * iovcnt);
+	memset(transfers, 0, sizeof(transfers));
+
+	count = bulkv_split(iov, iovcnt, mps, pieces, bounce);
+	if (count == 0) {
+		/* nothing but empty segments; send a zero length packet */
+		if (pieces != stack_pieces)
+			free(pieces);
+		return usb_bulk_io(dev, ep, (char *)iov[0].iov_base, 0, timeout);
+	}
+	depth = is_in ? 1 : (count < BULKV_DEPTH ? count : BULKV_DEPTH);
+	start = dev->stats ? Mpl_Clock_Ticks_Us() : 0;
+	if (timeout > 0)
+		deadline = Mpl_Clock_Ticks_Ms() + timeout;
+
+	UD_DBG("endpoint %x segments %d pieces %d\n", ep, iovcnt, count);
+
+	for (i = 0; i < depth; i++) {
+		if ((transfers[i] = libusb_alloc_transfer(0)) == NULL) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto Done;
+		}
+	}
+
+	tv.tv_sec = ASYNC_TIMVAL_SEC;
+	tv.tv_usec = 0;
+
+	for (;;) {
+		while (!stop && !expired && submitted < count && submitted - finished < depth) {
+			struct bulkv_piece *piece = &pieces[submitted];
+			unsigned int piece_timeout = 0;
+
+			if (deadline) {
+				now = Mpl_Clock_Ticks_Ms();
+				if (now >= deadline) {
+					/* the pieces in flight still finish on their own */
+					expired = 1;
+					break;
+				}
+				piece_timeout = (unsigned int)(deadline - now);
+			}
+			if (piece->bounce && !is_in)
+				bulkv_copy(iov, iovcnt, piece->offset, piece->buffer,
+					piece->length, 0);
+			piece->completed = &completed;
+			piece->transfer = transfers[submitted % depth];
+			libusb_fill_bulk_transfer(piece->transfer, dev->handle, ep & 0xff,
+				piece->buffer, piece->length, bulkv_cb, piece, piece_timeout);
+			if ((r = backend->submit_transfer(piece->transfer)) < 0) {
+				stop = 1;
+				break;
+			}
+			submitted++;
+		}
+
+		completed = 0;
+		while (finished < submitted && pieces[finished].done) {
+			struct bulkv_piece *piece = &pieces[finished++];
+			int status = piece->transfer->status;
+
+			if (stop && status == LIBUSB_TRANSFER_CANCELLED)
+				continue;
+			if (!stop) {
+				total += piece->transfer->actual_length;
+				if (piece->bounce && is_in)
+					bulkv_copy(iov, iovcnt, piece->offset, piece->buffer,
+						piece->transfer->actual_length, 1);
+			}
+			if (status != LIBUSB_TRANSFER_COMPLETED) {
+				if (!stop)
+					err = libusb_transfer_to_errno(status);
+				stop = 1;
+			} else if (piece->transfer->actual_length < piece->length) {
+				stop = 1;
+			}
+		}
+
+		if (stop && !cancelled) {
+			for (i = finished; i < submitted; i++) {
+				if (!pieces[i].done)
+					backend->cancel_transfer(pieces[i].transfer);
+			}
+			cancelled = 1;
+		}
+		if (finished == submitted && (stop || expired || submitted == count))
+			break;
+		/* a finished piece makes room for the next one */
+		if (!stop && !expired && submitted < count && submitted - finished < depth)
+			continue;
+
+		backend->handle_events_completed(&tv, &completed);
+	}
+
+Done:
+	for (i = 0; i < depth; i++) {
+		if (transfers[i])
+			libusb_free_transfer(transfers[i]);
+	}
+	if (pieces != stack_pieces)
+		free(pieces);
+
+	if (expired && !stop && !err)
+		err = ETIMEDOUT;
+
+	if (r < 0)
+		r = compat_err(r);
+	else if (err == ETIMEDOUT && total > 0) {
+		errno = ETIMEDOUT;
+		r = total;
+	}
+	else if (err)
+		r = -(errno=err);
+	else
+		r = total;
+
+	if (dev->stats && count > 0)
+		stats_complete(dev->stats, ep, Mpl_Clock_Ticks_Us() - start, r, 0);
+	return r;
+}
+
+API_EXPORTED int USBAPI_DECL usb_bulk_readv(usb_dev_handle *dev, int ep,
+	const struct usb_iovec *iov, int iovcnt, int timeout)
+{
+	return usb_bulk_iov(dev, ep | USB_ENDPOINT_IN, iov, iovcnt, timeout);
+}
+
+API_EXPORTED int USBAPI_DECL usb_bulk_writev(usb_dev_handle *dev, int ep,
+	const struct usb_iovec *iov, int iovcnt, int timeout)
+{
+	return usb_bulk_iov(dev, ep & ~USB_ENDPOINT_IN, iov, iovcnt, timeout);
+}
+
+///////////////////////////////////////
+/* synchronous transfers             */
+///////////////////////////////////////
+
+/*
+ * The synchronous bulk, interrupt and control calls of the libusb-1.0
+ * backend run on a transfer cached per handle rather than through
+ * libusb's synchronous helpers, which allocate a transfer, and for control
+ * transfers a setup buffer, on every call. Steady-state sync I/O on a
+ * handle so does no heap allocation. Control data still has to be copied to sit behind
+ * the setup packet, but only wLength bytes out and the received bytes in.
+ *
+ * The calling thread handles events until its transfer completes, as
+ * libusb's helpers do. With usb_init_params.sync_through_async set, the
+ * event thread completes it instead, so that sync calls do not queue up
+ * behind it for the event lock while async traffic is running.
+ *
+ * Each handle caches one transfer, which a call takes out of the handle
+ * and puts back when it is done. Calls made on the same handle from
+ * several threads at once use transfers of their own for the time being.
+ * The cached transfer goes with usb_close().
+ */
+struct usbi_sync_io
+{
+	struct libusb_transfer *transfer;
+	int completed;
+	MPL_EVENT_T done;
+
+	/* setup packet and data of control transfers, grown as needed */
+	unsigned char *control;
+	int control_size;
+};
+
+static void LIBUSB_CALL sync_io_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_sync_io *io = (struct usbi_sync_io *)transfer->user_data;
+
+	io->completed = 1;
+	if (sync_through_async)
+		Mpl_Event_Set(&io->done);
+}
+
+static void sync_io_free(struct usbi_sync_io *io)
+{
+	Mpl_Event_Free(&io->done);
+	libusb_free_transfer(io->transfer);
+	free(io->control);
+	free(io);
+}
+
+static struct usbi_sync_io *sync_io_get(usb_dev_handle *dev)
+{
+	struct usbi_sync_io *io = dev->sync_io;
+
+	if (io && MPL_Atomic_CmpExgPtr(&dev->sync_io, NULL, io))
+		return io;
+
+	if ((io = calloc(1, sizeof(*io))) == NULL)
+		return NULL;
+	if ((io->transfer = libusb_alloc_transfer(0)) == NULL) {
+		free(io);
+		return NULL;
+	}
+	if (Mpl_Event_Init(&io->done, 1, 0) != MPL_SUCCESS) {
+		libusb_free_transfer(io->transfer);
+		free(io);
+		return NULL;
+	}
+	return io;
+}
+
+/* caches io on the handle unless another call got there first */
+static void sync_io_put(usb_dev_handle *dev, struct usbi_sync_io *io)
+{
+	if (!MPL_Atomic_CmpExgPtr(&dev->sync_io, io, NULL))
+		sync_io_free(io);
+}
+
+static void sync_io_close(usb_dev_handle *dev)
+{
+	if (dev->sync_io) {
+		sync_io_free(dev->sync_io);
+		dev->sync_io = NULL;
+	}
+}
+
+/* submits the filled in transfer and waits for it; the transfer's own
+ * timeout ends it, so the wait itself has none */
+static int sync_io_run(struct usbi_sync_io *io)
+{
+	struct libusb_transfer *transfer = io->transfer;
+	struct timeval tv;
+	int r;
+
+	transfer->status = LIBUSB_TRANSFER_ERROR;
+	transfer->actual_length = 0;
+	io->completed = 0;
+
+	if (sync_through_async) {
+		async_fly_begin();
+		if ((r = backend->submit_transfer(transfer)) != LIBUSB_SUCCESS) {
+			async_fly_end();
+			return r;
 		}
+		async_wait_event(&io->done, INFINITE);
+		async_fly_end();
+	} else {
+		if ((r = backend->submit_transfer(transfer)) != LIBUSB_SUCCESS)
+			return r;
 
-#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
-		if (async_thread.fly_count == 0) {
-			libusb_unlock_events(ctx);
-			events_locked=0;
+		tv.tv_sec = ASYNC_TIMVAL_SEC;
+		tv.tv_usec = 0;
+		while (!io->completed) {
+			r = backend->handle_events_completed(&tv, &io->completed);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+				/* the transfer still has to complete before it is reused */
+				backend->cancel_transfer(transfer);
+				tv.tv_sec = 0;
+				tv.tv_usec = 10000;
+			}
+		}
+	}
 
-			if (async_thread.fly_count == 0)
-				Mpl_Event_Wait(&async_thread.event_running, ASYNC_TIMVAL_SEC * 1000);
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* same results as backend->bulk_transfer() */
+static int sync_io_transfer(usb_dev_handle *dev, unsigned char type,
+	unsigned char ep, unsigned char *data, int length, int *actual_length,
+	unsigned int timeout)
+{
+	struct usbi_sync_io *io = sync_io_get(dev);
+	int r;
+
+	*actual_length = 0;
+	if (!io)
+		return LIBUSB_ERROR_NO_MEM;
+
+	libusb_fill_bulk_transfer(io->transfer, dev->handle, ep, data, length,
+		sync_io_cb, io, timeout);
+	io->transfer->type = type;
+
+	r = sync_io_run(io);
+	*actual_length = io->transfer->actual_length;
+	sync_io_put(dev, io);
+	return r;
+}
+
+/* same results as backend->control_transfer() */
+static int sync_io_control(usb_dev_handle *dev, uint8_t bmRequestType,
+	uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data,
+	uint16_t wLength, unsigned int timeout)
+{
+	struct usbi_sync_io *io = sync_io_get(dev);
+	int size = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+	int r;
+
+	if (!io)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (io->control_size < size) {
+		unsigned char *control = realloc(io->control, size);
+		if (!control) {
+			sync_io_put(dev, io);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		io->control = control;
+		io->control_size = size;
+	}
+
+	libusb_fill_control_setup(io->control, bmRequestType, bRequest, wValue,
+		wIndex, wLength);
+	if (!(bmRequestType & LIBUSB_ENDPOINT_IN) && wLength)
+		memcpy(io->control + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+	libusb_fill_control_transfer(io->transfer, dev->handle, io->control,
+		sync_io_cb, io, timeout);
+
+	if ((r = sync_io_run(io)) == LIBUSB_SUCCESS) {
+		r = io->transfer->actual_length;
+		if (bmRequestType & LIBUSB_ENDPOINT_IN)
+			memcpy(data, io->control + LIBUSB_CONTROL_SETUP_SIZE, r);
+	}
+	sync_io_put(dev, io);
+	return r;
+}
+
+///////////////////////////////////////
+/* bulk streams                      */
+///////////////////////////////////////
+
+/*
+ * A stream keeps up to depth bulk transfers of chunk bytes in flight on one
+ * endpoint. IN streams submit every chunk at open and resubmit each one as
+ * soon as the reader has consumed it. OUT streams copy each write into a
+ * free chunk, submit it and return; a chunk is reaped again when the writer
+ * wraps around to it.
+ */
+struct usb_stream_slot
+{
+	void *context;
+	char *buffer;
+	int pending;
+};
+
+typedef struct usb_stream
+{
+	usb_dev_handle *dev;
+	unsigned char ep;
+	int depth;
+	int chunk;
+
+	/* oldest slot; IN: the one being read, OUT: the next one to fill */
+	int head;
+
+	/* IN: length of the reaped head chunk or -1, and how much is read */
+	int avail;
+	int offset;
+
+	/* first error of a write-behind transfer (OUT) or of a resubmit after
+	 * a read (IN), reported by the next call */
+	int error;
 
+	struct usb_stream_slot *slots;
+	char *buffers;
+
+	/* the handle's buffer list, which outlives the handle */
+	struct usbi_buffers *buffer_list;
+} usb_stream_t;
+
+/* waits for a slot; returns the transfer result or a negative errno. The
+ * slot is still pending if the wait itself timed out. */
+static int stream_reap(usb_stream_t *stream, int slot, int timeout)
+{
+	usb_async_transfer_t *async_context = stream->slots[slot].context;
+	int r;
+
+	r = async_wait_event(&async_context->complete_event, timeout ? timeout : (int)INFINITE);
+	if (r != MPL_SUCCESS)
+		return -(errno=r);
+
+	stream->slots[slot].pending = 0;
+	r = async_result(async_context);
+	async_stats_reaped(async_context);
+	if (r < 0) errno = -r;
+	return r;
+}
+
+static int stream_submit(usb_stream_t *stream, int slot, int size, int timeout)
+{
+	int r = async_submit(stream->slots[slot].context,
+		stream->slots[slot].buffer, size, timeout);
+
+	if (r == 0)
+		stream->slots[slot].pending = 1;
+	return r;
+}
+
+/* resubmits a read slot; a failure is kept for the next read, which also
+ * retries the slot once it comes round */
+static void stream_rearm(usb_stream_t *stream, int slot)
+{
+	int r;
+
+	if ((r = stream_submit(stream, slot, stream->chunk, 0)) < 0 && !stream->error)
+		stream->error = -r;
+}
+
+static void stream_free(usb_stream_t *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->depth; i++) {
+		if (!stream->slots[i].context)
 			continue;
+		if (stream->slots[i].pending) {
+			usb_cancel_async(stream->slots[i].context);
+			stream_reap(stream, i, 0);
 		}
-#endif
-		/*
-		checks that libusb is still happy for your thread to be performing event handling.
-		Sometimes, libusb needs to interrupt the event handler.
-		*/
-		if (!libusb_event_handling_ok(ctx)) {
-			libusb_unlock_events(ctx);
-			events_locked = 0;
+		usb_free_async(&stream->slots[i].context);
+	}
+	if (stream->buffers)
+		buffers_remove(stream->buffer_list, stream->buffers);
+	buffers_put(stream->buffer_list);
+	free(stream);
+}
+
+API_EXPORTED int USBAPI_DECL usb_stream_open(usb_dev_handle *dev, void **stream, unsigned char ep, int depth, int chunk)
+{
+	usb_stream_t *new_stream;
+	int i, r, mps;
+
+	if (!dev || !stream || depth < 1 || chunk < 1) return -(errno=EINVAL);
+	*stream = NULL;
+
+	/* a chunk that ends mid-packet would end every transfer with a short
+	 * packet */
+	if ((mps = usbi_max_packet_size(dev, ep)) <= 0 || chunk % mps)
+		return -(errno=EINVAL);
+
+	new_stream = malloc(sizeof(*new_stream) + (sizeof(struct usb_stream_slot) * depth));
+	if (!new_stream) return -(errno=ENOMEM);
+	memset(new_stream, 0, sizeof(*new_stream) + (sizeof(struct usb_stream_slot) * depth));
+
+	new_stream->dev = dev;
+	new_stream->ep = ep;
+	new_stream->depth = depth;
+	new_stream->chunk = chunk;
+	new_stream->avail = -1;
+	new_stream->slots = (struct usb_stream_slot *)(new_stream + 1);
+
+	/* kernel memory where possible, so that the chunks are not copied */
+	new_stream->buffers = usb_alloc_buffer(dev, (size_t)depth * chunk);
+	if (!new_stream->buffers) {
+		free(new_stream);
+		return -(errno=ENOMEM);
+	}
+	new_stream->buffer_list = buffers_get(dev->buffers);
+
+	for (i = 0; i < depth; i++) {
+		new_stream->slots[i].buffer = new_stream->buffers + ((size_t)i * chunk);
+		if ((r = usb_bulk_setup_async(dev, &new_stream->slots[i].context, ep)) < 0) {
+			stream_free(new_stream);
+			return r;
+		}
+		if ((ep & USB_ENDPOINT_IN) && (r = stream_submit(new_stream, i, chunk, 0)) < 0) {
+			stream_free(new_stream);
+			return r;
+		}
+	}
+
+	*stream = new_stream;
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_stream_read(void *stream, char *bytes, int size, int timeout)
+{
+	usb_stream_t *s = (usb_stream_t *)stream;
+	int r;
+
+	if (!s || !(s->ep & USB_ENDPOINT_IN) || (!bytes && size > 0)) return -(errno=EINVAL);
+
+	if (s->error) {
+		r = s->error;
+		s->error = 0;
+		return -(errno=r);
+	}
+
+	if (s->avail < 0) {
+		/* a chunk that failed to resubmit is retried here */
+		if (!s->slots[s->head].pending &&
+			(r = stream_submit(s, s->head, s->chunk, 0)) < 0)
+			return r;
+
+		if ((r = stream_reap(s, s->head, timeout)) < 0) {
+			if (s->slots[s->head].pending)
+				return r;
+			/* the transfer failed; rearm it and report the error */
+			stream_rearm(s, s->head);
+			return r;
+		}
+		s->avail = r;
+		s->offset = 0;
+	}
+
+	/* like usb_bulk_read(), a read never spans two transfers */
+	r = s->avail - s->offset;
+	if (r > size)
+		r = size;
+	memcpy(bytes, s->slots[s->head].buffer + s->offset, r);
+	s->offset += r;
+
+	if (s->offset == s->avail) {
+		s->avail = -1;
+		stream_rearm(s, s->head);
+		s->head = (s->head + 1) % s->depth;
+	}
+	return r;
+}
+
+API_EXPORTED int USBAPI_DECL usb_stream_write(void *stream, char *bytes, int size, int timeout)
+{
+	usb_stream_t *s = (usb_stream_t *)stream;
+	int written = 0;
+	int n, r;
+
+	if (!s || (s->ep & USB_ENDPOINT_IN) || (!bytes && size > 0)) return -(errno=EINVAL);
+
+	if (s->error) {
+		r = s->error;
+		s->error = 0;
+		return -(errno=r);
+	}
+
+	/* a write is one transfer, split into chunk sized transfers if needed */
+	do {
+		if (s->slots[s->head].pending) {
+			r = stream_reap(s, s->head, timeout);
+			if (s->slots[s->head].pending)
+				return written ? written : r;
+			if (r < 0) {
+				/* an earlier write-behind transfer failed; stop here so
+				 * the data after it does not go out */
+				if (!written)
+					return r;
+				s->error = -r;
+				return written;
+			}
+		}
+
+		n = size - written < s->chunk ? size - written : s->chunk;
+		memcpy(s->slots[s->head].buffer, bytes + written, n);
+		if ((r = stream_submit(s, s->head, n, timeout)) < 0)
+			return written ? written : r;
+
+		s->head = (s->head + 1) % s->depth;
+		written += n;
+	} while (written < size);
+
+	return written;
+}
+
+API_EXPORTED int USBAPI_DECL usb_stream_flush(void *stream, int timeout)
+{
+	usb_stream_t *s = (usb_stream_t *)stream;
+	int i, r;
+
+	if (!s) return -(errno=EINVAL);
+	if (s->ep & USB_ENDPOINT_IN) return 0;
+
+	/* oldest first, so the first error reported is the first one that
+	 * happened */
+	for (i = 0; i < s->depth; i++) {
+		int slot = (s->head + i) % s->depth;
+
+		if (!s->slots[slot].pending)
 			continue;
+		r = stream_reap(s, slot, timeout);
+		if (s->slots[slot].pending)
+			return r;
+		if (r < 0 && !s->error)
+			s->error = -r;
+	}
+
+	if (s->error) {
+		r = s->error;
+		s->error = 0;
+		return -(errno=r);
+	}
+	return 0;
+}
+
+API_EXPORTED int USBAPI_DECL usb_stream_close(void **stream)
+{
+	if (!stream || !*stream) return -(errno=EINVAL);
+
+	stream_free((usb_stream_t *)*stream);
+	*stream = NULL;
+	return 0;
+}
+
+///////////////////////////////////////
+/* isochronous streams               */
+///////////////////////////////////////
+
+/*
+ * An isochronous stream keeps depth transfers scheduled back to back and
+ * resubmits each one from its completion callback, so the schedule does
+ * not depend on how quickly the application reaps. Received packets go to
+ * the consumer callback or into a byte ring read with usb_iso_stream_read();
+ * OUT streams get their packets from the callback or from a ring filled
+ * with usb_iso_stream_write().
+ */
+struct usb_iso_stream_slot
+{
+	struct usb_iso_stream *stream;
+	struct libusb_transfer *transfer;
+	struct usb_iso_packet_result *packets;
+	muint64_t submit_us;
+	int pending;	/* submitted and not completed yet */
+};
+
+typedef struct usb_iso_stream
+{
+	usb_dev_handle *dev;
+	unsigned char ep;
+	struct usb_iso_stream_params params;
+	struct usbi_stats *stats;
+
+	/* protects everything below; held while the callback runs */
+	MPL_MUTEX_T lock;
+
+	volatile long in_flight;
+	int running;
+	int stopping;
+	int error;
+	MPL_EVENT_T idle;
+
+	/* byte ring, if params.ring_size is set */
+	unsigned char *ring;
+	int ring_head;
+	int ring_count;
+	MPL_EVENT_T ring_event;
+
+	struct usb_iso_stream_stats counters;
+	struct usb_iso_stream_slot *slots;
+	unsigned char *buffers;
+} usb_iso_stream_t;
+
+/* copies into the ring; must hold the lock */
+static void iso_ring_put(usb_iso_stream_t *s, const unsigned char *data, int length)
+{
+	while (length > 0) {
+		int tail = (s->ring_head + s->ring_count) % s->params.ring_size;
+		int n = s->params.ring_size - tail;
+		if (n > length)
+			n = length;
+		memcpy(s->ring + tail, data, n);
+		s->ring_count += n;
+		data += n;
+		length -= n;
+	}
+}
+
+/* copies out of the ring; must hold the lock */
+static void iso_ring_get(usb_iso_stream_t *s, unsigned char *data, int length)
+{
+	while (length > 0) {
+		int n = s->params.ring_size - s->ring_head;
+		if (n > length)
+			n = length;
+		memcpy(data, s->ring + s->ring_head, n);
+		s->ring_head = (s->ring_head + n) % s->params.ring_size;
+		s->ring_count -= n;
+		data += n;
+		length -= n;
+	}
+}
+
+/* prepares the packets of an OUT slot; returns non-zero to stop. must hold
+ * the lock */
+static int iso_stream_fill(usb_iso_stream_t *s, struct usb_iso_stream_slot *slot)
+{
+	struct libusb_transfer *transfer = slot->transfer;
+	int i, n, stop = 0;
+
+	for (i = 0; i < s->params.packets; i++) {
+		slot->packets[i].offset = i * s->params.pktsize;
+		slot->packets[i].length = s->params.pktsize;
+		slot->packets[i].status = 0;
+	}
+
+	if (s->params.callback) {
+		stop = s->params.callback(s->params.user_data, transfer->buffer,
+			slot->packets, s->params.packets);
+	} else {
+		/* packets the ring cannot fill go out empty */
+		for (i = 0; i < s->params.packets; i++) {
+			n = s->ring_count < s->params.pktsize ? s->ring_count : s->params.pktsize;
+			iso_ring_get(s, transfer->buffer + slot->packets[i].offset, n);
+			slot->packets[i].length = n;
 		}
-		r = libusb_handle_events_locked(ctx, &event_timeout_timeval);
+		if (slot->packets[s->params.packets - 1].length < s->params.pktsize)
+			s->counters.underruns++;
+		Mpl_Event_Set(&s->ring_event);
 	}
-	
-	if (events_locked)
-		libusb_unlock_events(ctx);
 
-Done:
-	if ((r = Mpl_Event_Set(&async_thread.event_terminated)) != MPL_SUCCESS)
-	{
-		UD_ERR("Mpl_Event_Set failed. ret=%d\n", r);
+	for (i = 0; i < s->params.packets; i++)
+		transfer->iso_packet_desc[i].length = slot->packets[i].length;
+	return stop;
+}
+
+/* must hold the lock */
+static int iso_stream_submit(usb_iso_stream_t *s, struct usb_iso_stream_slot *slot)
+{
+	int r;
+
+	if (!(s->ep & USB_ENDPOINT_IN) && iso_stream_fill(s, slot))
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	MPL_Atomic_Inc32(&s->in_flight);
+	async_fly_begin();
+	slot->submit_us = s->stats ? Mpl_Clock_Ticks_Us() : 0;
+	slot->pending = 1;
+	if ((r = backend->submit_transfer(slot->transfer)) < 0) {
+		slot->pending = 0;
+		MPL_Atomic_Dec32(&s->in_flight);
+		async_fly_end();
 	}
-	UD_INFO("thread user-stopped\n");
-	return (MPL_THDPROC_RETURN_TYPE)NULL;
+	return r;
 }
 
-static void async_free(usb_async_transfer_t* async_context)
+#ifdef _WIN32
+static void LIBUSB_CALL iso_stream_cb(struct libusb_transfer *transfer)
+#else
+static void iso_stream_cb(struct libusb_transfer *transfer)
+#endif
 {
-	libusb_free_transfer(async_context->transfer);
-	Mpl_Event_Free(&async_context->complete_event);
-	free(async_context);
+	struct usb_iso_stream_slot *slot = (struct usb_iso_stream_slot *)transfer->user_data;
+	usb_iso_stream_t *s = slot->stream;
+	int i, length = 0, errors = 0, stop = 0;
+	int r;
+
+	Mpl_Mutex_Wait(&s->lock);
+	slot->pending = 0;
+
+	/* nothing left scheduled behind this transfer: the bus went idle */
+	if (MPL_Atomic_Dec32(&s->in_flight) == 0 && !s->stopping)
+		s->counters.underruns++;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+		slot->packets[i].offset = i * s->params.pktsize;
+		slot->packets[i].length = 0;
+		slot->packets[i].status = -libusb_transfer_to_errno(desc->status);
+		if (desc->status == LIBUSB_TRANSFER_COMPLETED)
+			slot->packets[i].length = desc->actual_length;
+		else
+			errors++;
+		length += slot->packets[i].length;
+	}
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		s->counters.transfers++;
+		s->counters.packets += transfer->num_iso_packets;
+		s->counters.bytes += length;
+		s->counters.packet_errors += errors;
+	}
+	if (s->stats)
+		stats_complete(s->stats, s->ep, Mpl_Clock_Ticks_Us() - slot->submit_us,
+			transfer->status == LIBUSB_TRANSFER_COMPLETED ? length :
+			-libusb_transfer_to_errno(transfer->status),
+			transfer->status == LIBUSB_TRANSFER_CANCELLED);
+
+	if ((s->ep & USB_ENDPOINT_IN) && transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (s->params.callback) {
+			stop = s->params.callback(s->params.user_data, transfer->buffer,
+				slot->packets, transfer->num_iso_packets);
+		} else if (length > s->params.ring_size - s->ring_count) {
+			s->counters.overruns++;
+		} else {
+			for (i = 0; i < transfer->num_iso_packets; i++)
+				iso_ring_put(s, transfer->buffer + slot->packets[i].offset,
+					slot->packets[i].length);
+			if (length)
+				Mpl_Event_Set(&s->ring_event);
+		}
+	}
+
+	if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		s->error = ENODEV;
+		stop = 1;
+	}
+	if (!s->stopping && !stop && (r = iso_stream_submit(s, slot)) < 0 &&
+		r != LIBUSB_ERROR_INTERRUPTED && !s->error) {
+		s->error = libusb_to_errno(r);
+	}
+
+	if (s->in_flight == 0) {
+		s->running = 0;
+		Mpl_Event_Set(&s->ring_event);
+		Mpl_Event_Set(&s->idle);
+	}
+	Mpl_Mutex_Release(&s->lock);
+
+	async_fly_end();
+}
+
+/* must hold the lock */
+static int iso_stream_start(usb_iso_stream_t *s)
+{
+	int i, r = 0;
+
+	Mpl_Event_Reset(&s->idle);
+	s->running = 1;
+	for (i = 0; i < s->params.depth; i++) {
+		if ((r = iso_stream_submit(s, &s->slots[i])) < 0)
+			break;
+	}
+	if (s->in_flight == 0) {
+		s->running = 0;
+		Mpl_Event_Set(&s->idle);
+	}
+	if (r == LIBUSB_ERROR_INTERRUPTED)
+		r = 0;
+	return r < 0 ? compat_err(r) : 0;
+}
+
+/* cancels everything in flight and waits for the last completion */
+static void iso_stream_stop(usb_iso_stream_t *s)
+{
+	int i;
+
+	Mpl_Mutex_Wait(&s->lock);
+	s->stopping = 1;
+	for (i = 0; i < s->params.depth; i++) {
+		if (s->slots[i].pending)
+			backend->cancel_transfer(s->slots[i].transfer);
+	}
+	Mpl_Mutex_Release(&s->lock);
+
+	async_wait_event(&s->idle, INFINITE);
+
+	/* the last callback sets idle under the lock; wait for it to let go */
+	Mpl_Mutex_Wait(&s->lock);
+	Mpl_Mutex_Release(&s->lock);
+}
+
+static void iso_stream_free(usb_iso_stream_t *s)
+{
+	int i;
+
+	for (i = 0; i < s->params.depth; i++) {
+		if (s->slots[i].transfer)
+			libusb_free_transfer(s->slots[i].transfer);
+	}
+	stats_put(s->stats);
+	Mpl_Event_Free(&s->ring_event);
+	Mpl_Event_Free(&s->idle);
+	Mpl_Mutex_Free(&s->lock);
+	free(s->buffers);
+	free(s->ring);
+	free(s);
+}
+
+API_EXPORTED int USBAPI_DECL usb_iso_stream_open(usb_dev_handle *dev, void **stream, unsigned char ep, const struct usb_iso_stream_params *params)
+{
+	usb_iso_stream_t *s;
+	struct usb_iso_packet_result *packets;
+	size_t size;
+	int i, p, r;
+
+	if (!dev || !stream || !params) return -(errno=EINVAL);
+	if (params->pktsize < 1 || params->packets < 1 || params->depth < 1 ||
+		params->ring_size < 0 || (!params->callback && !params->ring_size))
+		return -(errno=EINVAL);
+	*stream = NULL;
+
+	/* the slots and their packet results follow the stream */
+	size = sizeof(*s) + (sizeof(struct usb_iso_stream_slot) * params->depth) +
+		(sizeof(struct usb_iso_packet_result) * params->packets * params->depth);
+	if ((s = malloc(size)) == NULL) return -(errno=ENOMEM);
+	memset(s, 0, size);
+
+	s->dev = dev;
+	s->ep = ep;
+	s->params = *params;
+	s->slots = (struct usb_iso_stream_slot *)(s + 1);
+	packets = (struct usb_iso_packet_result *)(s->slots + params->depth);
+
+	if (Mpl_Mutex_Init(&s->lock) != MPL_SUCCESS) {
+		free(s);
+		return -(errno=ENOMEM);
+	}
+	if ((r = Mpl_Event_Init(&s->idle, 0, 1)) != MPL_SUCCESS) {
+		Mpl_Mutex_Free(&s->lock);
+		free(s);
+		return -(errno=r);
+	}
+	if ((r = Mpl_Event_Init(&s->ring_event, 1, 0)) != MPL_SUCCESS) {
+		Mpl_Event_Free(&s->idle);
+		Mpl_Mutex_Free(&s->lock);
+		free(s);
+		return -(errno=r);
+	}
+	s->stats = stats_get(dev->stats);
+
+	s->buffers = malloc((size_t)params->depth * params->packets * params->pktsize);
+	if (params->ring_size)
+		s->ring = malloc(params->ring_size);
+	if (!s->buffers || (params->ring_size && !s->ring)) {
+		iso_stream_free(s);
+		return -(errno=ENOMEM);
+	}
+
+	for (i = 0; i < params->depth; i++) {
+		struct usb_iso_stream_slot *slot = &s->slots[i];
+		struct libusb_transfer *transfer;
+
+		if ((transfer = libusb_alloc_transfer(params->packets)) == NULL) {
+			iso_stream_free(s);
+			return -(errno=ENOMEM);
+		}
+		slot->stream = s;
+		slot->transfer = transfer;
+		slot->packets = packets + ((size_t)params->packets * i);
+
+		transfer->dev_handle = dev->handle;
+		transfer->endpoint = ep;
+		transfer->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+		transfer->timeout = 0;
+		transfer->buffer = s->buffers + ((size_t)params->packets * params->pktsize * i);
+		transfer->length = params->packets * params->pktsize;
+		transfer->num_iso_packets = params->packets;
+		transfer->callback = iso_stream_cb;
+		transfer->user_data = slot;
+		for (p = 0; p < params->packets; p++)
+			transfer->iso_packet_desc[p].length = params->pktsize;
+	}
+
+	/* OUT streams that write through the ring start with the first write */
+	if ((ep & USB_ENDPOINT_IN) || params->callback) {
+		Mpl_Mutex_Wait(&s->lock);
+		r = iso_stream_start(s);
+		Mpl_Mutex_Release(&s->lock);
+		if (r < 0) {
+			iso_stream_stop(s);
+			iso_stream_free(s);
+			return r;
+		}
+	}
+
+	*stream = s;
+	return 0;
 }
 
-static int async_dec_ref(usb_async_transfer_t* async_context)
+/* waits on the ring event; returns 0, or a negative errno when the wait
+ * timed out. timeout 0 waits forever */
+static int iso_stream_wait(usb_iso_stream_t *s, muint64_t deadline)
 {
-	int r = EAGAIN;
-	if ((r=MPL_Atomic_Dec32(&async_context->ref_count)) == 0)
-	{
-		async_free(async_context);
-		r = 0;
-	} else if (r < 0) {
-		UD_ERR("invalid transfer context; possible memory courruption\n");
-		return EACCES;
-	}
+	int wait = INFINITE;
+	int r;
 
-#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
-	if (MPL_Atomic_Dec32(&async_thread.fly_count) == 0) {
-		Mpl_Event_Reset(&async_thread.event_running);
+	if (deadline) {
+		muint64_t now = Mpl_Clock_Ticks_Ms();
+		if (now >= deadline)
+			return -(errno=ETIMEDOUT);
+		wait = (int)(deadline - now);
 	}
-#endif
-	return r;
+	r = async_wait_event(&s->ring_event, wait);
+	return (r == MPL_SUCCESS) ? 0 : -(errno=r);
 }
 
-static int async_inc_ref(usb_async_transfer_t* async_context) 
+API_EXPORTED int USBAPI_DECL usb_iso_stream_read(void *stream, char *bytes, int size, int timeout)
 {
+	usb_iso_stream_t *s = (usb_iso_stream_t *)stream;
+	muint64_t deadline = timeout > 0 ? Mpl_Clock_Ticks_Ms() + timeout : 0;
 	int r;
-	if ((r=MPL_Atomic_Inc32(&async_context->ref_count)) < 1)
-	{
-		MPL_Atomic_Dec32(&async_context->ref_count);
-		UD_ERR("transfer is pending de-allocation\n");
-		return EACCES;
-	}
-#ifdef ALLOW_HANDLE_EVENTS_THREAD_IDLE
-	else {
 
-		if (MPL_Atomic_Inc32(&async_thread.fly_count) == 1) {
-			Mpl_Event_Set(&async_thread.event_running);
+	if (!s || !s->ring || !(s->ep & USB_ENDPOINT_IN) || (!bytes && size > 0))
+		return -(errno=EINVAL);
+
+	for (;;) {
+		Mpl_Mutex_Wait(&s->lock);
+		if (s->ring_count > 0) {
+			r = s->ring_count < size ? s->ring_count : size;
+			iso_ring_get(s, (unsigned char *)bytes, r);
+			Mpl_Mutex_Release(&s->lock);
+			return r;
+		}
+		if (!s->running) {
+			r = s->error ? s->error : EPIPE;
+			Mpl_Mutex_Release(&s->lock);
+			return -(errno=r);
 		}
+		Mpl_Mutex_Release(&s->lock);
+
+		if ((r = iso_stream_wait(s, deadline)) < 0)
+			return r;
 	}
-#endif
-	return 0;
 }
 
-static int async_stop_events(unsigned char wait_for_terminate) 
+API_EXPORTED int USBAPI_DECL usb_iso_stream_write(void *stream, char *bytes, int size, int timeout)
 {
-	Mpl_Mutex_Wait(&async_thread.init_mutex);
-	if (async_thread.is_run)
-	{
-		MPL_Atomic_Dec32(&async_thread.is_run);
-		Mpl_Event_Set(&async_thread.event_running);
+	usb_iso_stream_t *s = (usb_iso_stream_t *)stream;
+	muint64_t deadline = timeout > 0 ? Mpl_Clock_Ticks_Ms() + timeout : 0;
+	int written = 0;
+	int n, r;
 
-		Mpl_Event_Wait(&async_thread.event_terminated, INFINITE);
+	if (!s || !s->ring || (s->ep & USB_ENDPOINT_IN) || (!bytes && size > 0))
+		return -(errno=EINVAL);
 
-		Mpl_Event_Reset(&async_thread.event_running);
+	for (;;) {
+		Mpl_Mutex_Wait(&s->lock);
+		if (s->error) {
+			r = s->error;
+			Mpl_Mutex_Release(&s->lock);
+			return written ? written : -(errno=r);
+		}
+
+		n = s->params.ring_size - s->ring_count;
+		if (n > size - written)
+			n = size - written;
+		iso_ring_put(s, (unsigned char *)bytes + written, n);
+		written += n;
+
+		if (!s->running && !s->stopping && (r = iso_stream_start(s)) < 0) {
+			s->error = -r;
+			Mpl_Mutex_Release(&s->lock);
+			return written ? written : r;
+		}
+		Mpl_Mutex_Release(&s->lock);
 
+		if (written == size)
+			return written;
+		if ((r = iso_stream_wait(s, deadline)) < 0)
+			return written ? written : r;
 	}
-	Mpl_Mutex_Release(&async_thread.init_mutex);
+}
+
+API_EXPORTED int USBAPI_DECL usb_iso_stream_get_stats(void *stream, struct usb_iso_stream_stats *stats, int reset)
+{
+	usb_iso_stream_t *s = (usb_iso_stream_t *)stream;
+
+	if (!s || !stats) return -(errno=EINVAL);
+
+	Mpl_Mutex_Wait(&s->lock);
+	memcpy(stats, &s->counters, sizeof(*stats));
+	if (reset)
+		memset(&s->counters, 0, sizeof(s->counters));
+	Mpl_Mutex_Release(&s->lock);
 	return 0;
 }
 
-static int async_start_events(void) 
+API_EXPORTED int USBAPI_DECL usb_iso_stream_close(void **stream)
 {
-	int r = 0;
-	if (async_thread.is_run) return 0;
+	usb_iso_stream_t *s;
 
-	if ((r = MPL_Atomic_Inc32(&async_thread.is_run)) == 1)
-	{
-		Mpl_Mutex_Wait(&async_thread.init_mutex);
+	if (!stream || !*stream) return -(errno=EINVAL);
+	s = (usb_iso_stream_t *)*stream;
+	*stream = NULL;
 
-		/* This thread will run in the background; create it 'detached'. */
-		r = Mpl_Thread_Init(&async_thread.handle, async_event_handler, &async_thread);
-		if (r == MPL_SUCCESS) {
-			Mpl_Event_Set(&async_thread.event_running);
-			UD_INFO("thread started.\n");
-		} else {
-			MPL_Atomic_Dec32(&async_thread.is_run);
-			UD_ERR("Mpl_Thread_Init() failed. ret=%d\n",r);
-		}
+	iso_stream_stop(s);
+	iso_stream_free(s);
+	return 0;
+}
 
-		Mpl_Mutex_Release(&async_thread.init_mutex);
+///////////////////////////////////////
+/* interrupt polling                 */
+///////////////////////////////////////
+
+/*
+ * A poller keeps depth interrupt IN transfers queued and resubmits each one
+ * from its completion callback. Completions are handled under the poller
+ * lock, so the ring has a single producer; the reader only moves the tail
+ * and takes no lock. The user callback runs outside the lock, so it may
+ * read the stats; the transfer stays counted in flight until it returns.
+ * In latest mode three report buffers rotate instead: the event thread
+ * fills back, the reader owns front and middle holds the freshest
+ * complete report, marked fresh until the reader takes it.
+ */
+#define POLL_FRESH	(0x4)
+
+struct usb_interrupt_poll_slot
+{
+	struct usb_interrupt_poll *poll;
+	struct libusb_transfer *transfer;
+	muint64_t submit_us;
+	int pending;	/* submitted and not completed yet */
+};
+
+/* a report in the ring or in a latest buffer; data follows */
+struct usb_interrupt_poll_report
+{
+	muint64_t timestamp_us;
+	int length;
+};
+
+typedef struct usb_interrupt_poll
+{
+	usb_dev_handle *dev;
+	unsigned char ep;
+	struct usb_interrupt_poll_params params;
+	struct usbi_stats *stats;
+
+	/* protects everything below but the ring indices and the latest
+	 * buffers */
+	MPL_MUTEX_T lock;
+
+	volatile long in_flight;
+	volatile int running;
+	int stopping;
+	int error;
+	MPL_EVENT_T idle;
+
+	struct usb_interrupt_poll_stats counters;
+	struct usb_interrupt_poll_slot *slots;
+	unsigned char *buffers;
+
+	/* reports, params.ring_reports of them or three in latest mode */
+	unsigned char *reports;
+	size_t report_stride;
+	MPL_EVENT_T report_event;
+
+	/* ring; the event thread puts at put_index and counts the report in,
+	 * the reader takes at get_index and counts it out */
+	volatile long count;
+	int put_index;
+	int get_index;
+
+	/* latest mode buffer indices */
+	volatile long latest_middle;
+	int latest_back;
+	int latest_front;
+} usb_interrupt_poll_t;
+
+static struct usb_interrupt_poll_report *poll_report(usb_interrupt_poll_t *p, long index)
+{
+	return (struct usb_interrupt_poll_report *)(p->reports + (p->report_stride * index));
+}
+
+static long poll_exchange(volatile long *value, long new_value)
+{
+	long old_value;
+
+	do {
+		old_value = *value;
+	} while (!MPL_Atomic_CmpExg32(value, new_value, old_value));
+	return old_value;
+}
+
+/* must hold the lock */
+static void poll_put(usb_interrupt_poll_t *p, const unsigned char *data,
+	int length, muint64_t timestamp_us)
+{
+	struct usb_interrupt_poll_report *report;
+	long old_middle;
 
+	if (p->params.flags & USB_INTERRUPT_POLL_LATEST) {
+		report = poll_report(p, p->latest_back);
 	} else {
-		MPL_Atomic_Dec32(&async_thread.is_run);
-		r=0;
+		if (p->count == p->params.ring_reports) {
+			p->counters.dropped++;
+			return;
+		}
+		report = poll_report(p, p->put_index);
 	}
 
-	return r;
+	report->timestamp_us = timestamp_us;
+	report->length = length;
+	memcpy(report + 1, data, length);
+
+	/* the atomics order the copy before the report is published */
+	if (p->params.flags & USB_INTERRUPT_POLL_LATEST) {
+		old_middle = poll_exchange(&p->latest_middle, p->latest_back | POLL_FRESH);
+		if (old_middle & POLL_FRESH)
+			p->counters.dropped++;
+		p->latest_back = old_middle & ~POLL_FRESH;
+	} else {
+		p->put_index = (p->put_index + 1) % p->params.ring_reports;
+		MPL_Atomic_Inc32(&p->count);
+	}
+	Mpl_Event_Set(&p->report_event);
 }
 
-/* libusb-1.0 callback proc for all asynchronous bulk and interrupt transfers */
-#ifdef _WIN32
-static void LIBUSB_CALL async_bulk_cb(struct libusb_transfer *transfer)
-#else
-static void async_bulk_cb(struct libusb_transfer *transfer)
-#endif
+/* takes the next report without locking; returns NULL if there is none.
+ * poll_release() hands a ring report back once it has been copied */
+static struct usb_interrupt_poll_report *poll_get(usb_interrupt_poll_t *p)
 {
-	usb_async_transfer_t *async_context = (usb_async_transfer_t*)transfer->user_data;
+	if (p->params.flags & USB_INTERRUPT_POLL_LATEST) {
+		if (!(p->latest_middle & POLL_FRESH))
+			return NULL;
+		p->latest_front = poll_exchange(&p->latest_middle, p->latest_front) & ~POLL_FRESH;
+		return poll_report(p, p->latest_front);
+	}
 
-	/* signal the complete event */
-	Mpl_Event_Set(&async_context->complete_event);
+	if (p->count == 0)
+		return NULL;
+	return poll_report(p, p->get_index);
+}
 
-	/* decrement ref */
-	async_dec_ref(async_context);
+static void poll_release(usb_interrupt_poll_t *p)
+{
+	if (!(p->params.flags & USB_INTERRUPT_POLL_LATEST)) {
+		p->get_index = (p->get_index + 1) % p->params.ring_reports;
+		MPL_Atomic_Dec32(&p->count);
+	}
 }
 
-static int async_submit(void *context, char *bytes, int size, unsigned int timeout)
+/* must hold the lock */
+static int poll_submit(usb_interrupt_poll_t *p, struct usb_interrupt_poll_slot *slot)
 {
 	int r;
-	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
-	if (!async_context || (!bytes && size > 0) || async_context->ref_count != 1) return -(errno=EINVAL);
-
-	if (async_context->legacy_iso_pktsize && async_context->transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-		int num_packets = size / async_context->legacy_iso_pktsize;
-		int ipacket;
-		if (num_packets==0 || num_packets > 1024) {
-			UD_ERR("invalid number of iso packets. num_packets=%d\n",num_packets);
-			 return -(errno=EINVAL);
-		}
 
-		async_context->transfer->num_iso_packets = num_packets;
-		for (ipacket=0; ipacket < num_packets; ipacket++)
-			async_context->transfer->iso_packet_desc[ipacket].length=async_context->legacy_iso_pktsize;
+	MPL_Atomic_Inc32(&p->in_flight);
+	async_fly_begin();
+	slot->submit_us = p->stats ? Mpl_Clock_Ticks_Us() : 0;
+	slot->pending = 1;
+	if ((r = backend->submit_transfer(slot->transfer)) < 0) {
+		slot->pending = 0;
+		MPL_Atomic_Dec32(&p->in_flight);
+		async_fly_end();
 	}
+	return r;
+}
 
-	r = async_inc_ref(async_context);
-	if (r != 0) return -(errno=r);
+#ifdef _WIN32
+static void LIBUSB_CALL poll_cb(struct libusb_transfer *transfer)
+#else
+static void poll_cb(struct libusb_transfer *transfer)
+#endif
+{
+	struct usb_interrupt_poll_slot *slot = (struct usb_interrupt_poll_slot *)transfer->user_data;
+	usb_interrupt_poll_t *p = slot->poll;
+	muint64_t now = Mpl_Clock_Ticks_Us();
+	int stop = 0;
+	int r;
 
-	async_context->transfer->buffer			= (unsigned char*)&bytes[0];
-	async_context->transfer->length			= size;
-	async_context->transfer->status			= LIBUSB_TRANSFER_ERROR;
-	async_context->transfer->actual_length	= 0;
-	async_context->transfer->timeout		= timeout;
+	Mpl_Mutex_Wait(&p->lock);
+	slot->pending = 0;
+	if (p->stats)
+		stats_complete(p->stats, p->ep, now - slot->submit_us,
+			transfer->status == LIBUSB_TRANSFER_COMPLETED ? transfer->actual_length :
+			-libusb_transfer_to_errno(transfer->status),
+			transfer->status == LIBUSB_TRANSFER_CANCELLED);
 
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		p->counters.reports++;
+		p->counters.bytes += transfer->actual_length;
+		if (!p->params.callback)
+			poll_put(p, transfer->buffer, transfer->actual_length, now);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		/* resubmitting would only fail again */
+		p->counters.errors++;
+		if (!p->error)
+			p->error = libusb_transfer_to_errno(transfer->status);
+		stop = 1;
+		break;
+	default:
+		p->counters.errors++;
+		break;
+	}
+	Mpl_Mutex_Release(&p->lock);
 
-	Mpl_Event_Reset(&async_context->complete_event);
+	if (p->params.callback && transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		stop = p->params.callback(p->params.user_data, transfer->buffer,
+			transfer->actual_length, now);
 
-	r = libusb_submit_transfer(async_context->transfer);
-	if (r != LIBUSB_SUCCESS) {
+	Mpl_Mutex_Wait(&p->lock);
+	MPL_Atomic_Dec32(&p->in_flight);
+	if (!p->stopping && !stop && (r = poll_submit(p, slot)) < 0 && !p->error)
+		p->error = libusb_to_errno(r);
 
-		async_dec_ref(async_context);
-		return compat_err(r);
+	if (p->in_flight == 0) {
+		p->running = 0;
+		Mpl_Event_Set(&p->report_event);
+		Mpl_Event_Set(&p->idle);
 	}
+	Mpl_Mutex_Release(&p->lock);
 
-	return 0;
+	async_fly_end();
 }
 
-static int async_reap(void *context, int timeout, int cancel_on_timeout)
+/* cancels everything in flight and waits for the last completion */
+static void poll_stop(usb_interrupt_poll_t *p)
 {
-	int r=0;
-	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
-	if (!async_context || async_context->ref_count < 1) return -(errno=EINVAL);
+	int i;
 
-	if (async_inc_ref(async_context) != 0)
-	{
-		UD_ERR("transfer is pending de-allocation\n");
-		return  -(errno=EACCES);
-	}
-reap_retry_for_cancel:
-	r = Mpl_Event_Wait(&async_context->complete_event, timeout);
-	if (r == ETIMEDOUT && cancel_on_timeout) {
-		usb_cancel_async(context);
-		cancel_on_timeout = 0;
-		timeout = -1;
-		goto reap_retry_for_cancel;
+	Mpl_Mutex_Wait(&p->lock);
+	p->stopping = 1;
+	for (i = 0; i < p->params.depth; i++) {
+		if (p->slots[i].pending)
+			backend->cancel_transfer(p->slots[i].transfer);
 	}
+	Mpl_Mutex_Release(&p->lock);
 
-	if (r == MPL_SUCCESS) {
+	async_wait_event(&p->idle, INFINITE);
 
-		r = libusb_transfer_to_errno(async_context->transfer->status);
-		if (r==0 || (r == ETIMEDOUT && async_context->transfer->actual_length > 0)) {
-			async_dec_ref(async_context);
-			return async_context->transfer->actual_length;
-		}
-	}
+	/* the last callback sets idle under the lock; wait for it to let go */
+	Mpl_Mutex_Wait(&p->lock);
+	Mpl_Mutex_Release(&p->lock);
+}
 
-	async_dec_ref(async_context);
-	return -(errno=r);
+static void poll_free(usb_interrupt_poll_t *p)
+{
+	int i;
+
+	for (i = 0; i < p->params.depth; i++) {
+		if (p->slots[i].transfer)
+			libusb_free_transfer(p->slots[i].transfer);
+	}
+	stats_put(p->stats);
+	Mpl_Event_Free(&p->report_event);
+	Mpl_Event_Free(&p->idle);
+	Mpl_Mutex_Free(&p->lock);
+	free(p->buffers);
+	free(p->reports);
+	free(p);
 }
 
-static int usb_setup_async(usb_dev_handle *dev, void **context, unsigned char transfer_type, unsigned char ep, int num_iso_packets)
+API_EXPORTED int USBAPI_DECL usb_interrupt_poll_open(usb_dev_handle *dev, void **poll, unsigned char ep, const struct usb_interrupt_poll_params *params)
 {
-	usb_async_transfer_t *async_context;
+	usb_interrupt_poll_t *p;
+	int latest, count, i, r = 0;
+	size_t size;
+
+	if (!dev || !poll || !params) return -(errno=EINVAL);
+	latest = params->flags & USB_INTERRUPT_POLL_LATEST;
+	if (!(ep & USB_ENDPOINT_IN) || params->report_size < 1 || params->depth < 1 ||
+		params->ring_reports < 0 || (params->flags & ~USB_INTERRUPT_POLL_LATEST) ||
+		(!params->callback && !latest && !params->ring_reports))
+		return -(errno=EINVAL);
+	*poll = NULL;
 
-	async_context = malloc(sizeof(usb_async_transfer_t));
-	if (!async_context) return -(errno=ENOMEM);
-	memset(async_context,0,sizeof(usb_async_transfer_t));
+	/* the slots follow the poller */
+	size = sizeof(*p) + (sizeof(struct usb_interrupt_poll_slot) * params->depth);
+	if ((p = malloc(size)) == NULL) return -(errno=ENOMEM);
+	memset(p, 0, size);
 
-	async_context->transfer	= libusb_alloc_transfer(num_iso_packets);
-	if (!async_context->transfer) {
-		free(async_context);
+	p->dev = dev;
+	p->ep = ep;
+	p->params = *params;
+	p->slots = (struct usb_interrupt_poll_slot *)(p + 1);
+
+	if (Mpl_Mutex_Init(&p->lock) != MPL_SUCCESS) {
+		free(p);
+		return -(errno=ENOMEM);
+	}
+	if ((r = Mpl_Event_Init(&p->idle, 0, 1)) != MPL_SUCCESS) {
+		Mpl_Mutex_Free(&p->lock);
+		free(p);
+		return -(errno=r);
+	}
+	if ((r = Mpl_Event_Init(&p->report_event, 1, 0)) != MPL_SUCCESS) {
+		Mpl_Event_Free(&p->idle);
+		Mpl_Mutex_Free(&p->lock);
+		free(p);
+		return -(errno=r);
+	}
+	p->stats = stats_get(dev->stats);
+
+	/* reports keep their timestamps aligned */
+	p->report_stride = (sizeof(struct usb_interrupt_poll_report) + params->report_size + 7) & ~(size_t)7;
+	count = params->callback ? 0 : (latest ? 3 : params->ring_reports);
+	p->latest_back = 0;
+	p->latest_middle = 1;
+	p->latest_front = 2;
+
+	p->buffers = malloc((size_t)params->depth * params->report_size);
+	if (count)
+		p->reports = malloc(p->report_stride * count);
+	if (!p->buffers || (count && !p->reports)) {
+		poll_free(p);
 		return -(errno=ENOMEM);
 	}
 
-	Mpl_Event_Init(&async_context->complete_event,0,0);
-	async_context->dev = dev;
-	async_context->ref_count = 1;
-	async_context->transfer->callback = async_bulk_cb;
-	async_context->transfer->dev_handle = dev->handle;
-	async_context->transfer->endpoint = ep;
-	async_context->transfer->timeout = 0;
-	async_context->transfer->type = transfer_type;
-	async_context->transfer->status = LIBUSB_TRANSFER_ERROR;
-	async_context->transfer->user_data = async_context;
+	for (i = 0; i < params->depth; i++) {
+		struct usb_interrupt_poll_slot *slot = &p->slots[i];
 
-	*context = async_context;
+		if ((slot->transfer = libusb_alloc_transfer(0)) == NULL) {
+			poll_free(p);
+			return -(errno=ENOMEM);
+		}
+		slot->poll = p;
+		libusb_fill_interrupt_transfer(slot->transfer, dev->handle, ep,
+			p->buffers + ((size_t)params->report_size * i), params->report_size,
+			poll_cb, slot, 0);
+	}
 
-	return LIBUSB_SUCCESS;
-}
+	Mpl_Mutex_Wait(&p->lock);
+	Mpl_Event_Reset(&p->idle);
+	p->running = 1;
+	for (i = 0; i < params->depth; i++) {
+		if ((r = poll_submit(p, &p->slots[i])) < 0)
+			break;
+	}
+	if (p->in_flight == 0) {
+		p->running = 0;
+		Mpl_Event_Set(&p->idle);
+	}
+	Mpl_Mutex_Release(&p->lock);
 
-///////////////////////////////////////////////////////////////////
-/* libusb0(M)ulti-platform libusb-win32 async compatiblity layer */
-///////////////////////////////////////////////////////////////////
+	if (r < 0) {
+		poll_stop(p);
+		poll_free(p);
+		return compat_err(r);
+	}
 
-API_EXPORTED int USBAPI_DECL usb_bulk_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
-{
-	return usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_BULK, ep, 0);
+	*poll = p;
+	return 0;
 }
 
-API_EXPORTED int USBAPI_DECL usb_interrupt_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
+API_EXPORTED int USBAPI_DECL usb_interrupt_poll_read(void *poll, char *bytes, int size, uint64_t *timestamp_us, int timeout)
 {
-	return usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_INTERRUPT, ep, 0);
-}
+	usb_interrupt_poll_t *p = (usb_interrupt_poll_t *)poll;
+	muint64_t deadline = timeout > 0 ? Mpl_Clock_Ticks_Ms() + timeout : 0;
+	struct usb_interrupt_poll_report *report;
+	int stopped, wait, r;
 
-API_EXPORTED int USBAPI_DECL usb_isochronous_setup_async(usb_dev_handle *dev, void **context, unsigned char ep, int pktsize)
-{
-	int r;
-	if ((r = usb_setup_async(dev, context, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, ep, 1024)) == 0)
-	{
-		usb_async_transfer_t *async_context = (usb_async_transfer_t*)*context;
-		async_context->legacy_iso_pktsize = pktsize;
-		async_context->transfer->num_iso_packets = 1024;
-	}
-	return r;
-}
+	if (!p || !p->reports || (!bytes && size > 0))
+		return -(errno=EINVAL);
 
-API_EXPORTED int USBAPI_DECL usb_submit_async(void *context, char *bytes, int size)
-{
-	return async_submit(context, bytes, size, 0);
-}
+	for (;;) {
+		/* running is cleared after the last report was put, so a report
+		 * is still picked up after polling stopped */
+		stopped = !p->running;
+		if ((report = poll_get(p)) != NULL) {
+			r = report->length < size ? report->length : size;
+			memcpy(bytes, report + 1, r);
+			if (timestamp_us)
+				*timestamp_us = report->timestamp_us;
+			poll_release(p);
+			return r;
+		}
 
-API_EXPORTED int USBAPI_DECL usb_reap_async(void *context, int timeout)
-{
-	return async_reap(context,timeout, 1);
-}
+		if (stopped) {
+			r = p->error ? p->error : EPIPE;
+			return -(errno=r);
+		}
 
-API_EXPORTED int USBAPI_DECL usb_reap_async_nocancel(void *context, int timeout)
-{
-	return async_reap(context,timeout, 0);
+		wait = INFINITE;
+		if (deadline) {
+			muint64_t now = Mpl_Clock_Ticks_Ms();
+			if (now >= deadline)
+				return -(errno=ETIMEDOUT);
+			wait = (int)(deadline - now);
+		}
+		if ((r = async_wait_event(&p->report_event, wait)) != MPL_SUCCESS)
+			return -(errno=r);
+	}
 }
 
-API_EXPORTED int USBAPI_DECL usb_cancel_async(void *context)
+API_EXPORTED int USBAPI_DECL usb_interrupt_poll_get_stats(void *poll, struct usb_interrupt_poll_stats *stats, int reset)
 {
-	int r;
-	usb_async_transfer_t *async_context = (usb_async_transfer_t*)context;
-	if (!async_context) return -(errno=EINVAL);
+	usb_interrupt_poll_t *p = (usb_interrupt_poll_t *)poll;
 
-	if (async_context->ref_count > 1) {
-		r = libusb_cancel_transfer(async_context->transfer);
-		if (r != 0) return compat_err(r);
-	}
+	if (!p || !stats) return -(errno=EINVAL);
+
+	Mpl_Mutex_Wait(&p->lock);
+	memcpy(stats, &p->counters, sizeof(*stats));
+	if (reset)
+		memset(&p->counters, 0, sizeof(p->counters));
+	Mpl_Mutex_Release(&p->lock);
 	return 0;
 }
 
-API_EXPORTED int USBAPI_DECL usb_free_async(void **context)
+API_EXPORTED int USBAPI_DECL usb_interrupt_poll_close(void **poll)
 {
-	int r;
-	usb_async_transfer_t *async_context;
-	if (!context || !*context) return -(errno=EINVAL);
-	async_context = (usb_async_transfer_t*)*context;
-	*context = NULL;
-	r = async_dec_ref(async_context);
-	if (r!=0) return -(errno=r);
+	usb_interrupt_poll_t *p;
+
+	if (!poll || !*poll) return -(errno=EINVAL);
+	p = (usb_interrupt_poll_t *)*poll;
+	*poll = NULL;
 
+	poll_stop(p);
+	poll_free(p);
 	return 0;
 }
 
@@ -1446,12 +5178,12 @@ API_EXPORTED void USBAPI_DECL usb_exit(void)
 
 		async_stop_events(1);
 
-		libusb_exit(ctx);
-		ctx = NULL;
-
 		Mpl_Event_Free(&async_thread.event_running);
 		Mpl_Event_Free(&async_thread.event_terminated);
 		Mpl_Mutex_Free(&async_thread.init_mutex);
+
+		backend->exit();
+		backend = &usbi_libusb10_backend;
 		Mpl_Free();
 	}
 }
@@ -0,0 +1,941 @@
+/*
+ * libusb-win32 extensions:
+ * Simulated benchmark device backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Emulates a device running the benchmark firmware (see examples/benchmark.c)
+ * without any USB hardware. The device has one configuration with one
+ * interface and a pair of endpoints, 0x01 (OUT) and 0x81 (IN). The
+ * SET_TEST/GET_TEST vendor requests select what the endpoints do:
+ *
+ *   read  : the IN endpoint returns the benchmark data pattern
+ *   write : the OUT endpoint discards everything written to it
+ *   loop  : data written to the OUT endpoint is returned by the IN endpoint
+ *
+ * Transfers are scheduled on a per-direction bus clock. Each transfer
+ * occupies its direction for length / bytes_per_sec and completes
+ * latency_us after that. Completions are delivered from
+ * handle_events_locked(), so the async layer sees the same callback path
+ * as with libusb-1.0. Synchronous transfers run the event loop themselves,
+ * the same way the libusb-1.0 sync helpers do.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+
+#define USB0_LOG_APPNAME "Usb0Sim"
+#include "ud_error.h"
+
+#include "mpl_threads.h"
+#include "usb.h"
+#include "usbi.h"
+
+#define SIM_BUS_LOCATION	1
+#define SIM_DEVNUM		1
+#define SIM_EP_OUT		0x01
+#define SIM_EP_IN		0x81
+#define SIM_LOOP_FIFO_SIZE	(64 * 1024)
+
+/* Custom vendor requests implemented by the benchmark firmware. */
+#define SIM_SET_TEST		0x0E
+#define SIM_GET_TEST		0x0F
+
+#define SIM_TEST_READ		0x01
+#define SIM_TEST_WRITE		0x02
+#define SIM_TEST_LOOP		(SIM_TEST_READ | SIM_TEST_WRITE)
+
+static const char *sim_strings[] = {
+	NULL,
+	"libusb0(M) Simulator",
+	"Benchmark Device",
+};
+
+/* A queued transfer. */
+struct sim_urb {
+	struct sim_urb *next, *prev;
+
+	/* NULL for synchronous requests */
+	struct libusb_transfer *transfer;
+
+	unsigned char endpoint;
+	unsigned char type;
+	unsigned char *buffer;
+	int length;
+	int actual_length;
+	int status;
+	int cancelled;
+	int done;
+
+	muint64_t due_us;
+	muint64_t deadline_us;
+};
+
+/* A thread waiting in sim_run(); sim_wake() sets the event of each. */
+struct sim_waiter {
+	struct sim_waiter *next, *prev;
+	MPL_EVENT_T event;
+};
+
+static struct {
+	MPL_MUTEX_T lock;
+
+	/* threads waiting for the next event */
+	struct sim_waiter *waiters;
+
+	struct usb_sim_params params;
+	int test_type;
+
+	/* pending urbs in submission order */
+	struct sim_urb *pending;
+	struct sim_urb *pending_tail;
+	struct sim_urb *free_urbs;
+
+	/* time at which each direction's bus becomes idle. [0]=OUT [1]=IN */
+	muint64_t busy_until_us[2];
+
+	/* read test data pattern for one packet; byte 1 is the packet key */
+	unsigned char *pattern;
+	unsigned char key;
+
+	/* loop test data */
+	unsigned char *fifo;
+	int fifo_head;
+	int fifo_count;
+} sim;
+
+static struct usb_endpoint_descriptor sim_endpoints[2];
+static struct usb_interface_descriptor sim_altsetting;
+static struct usb_interface sim_interface;
+static struct usb_config_descriptor sim_config;
+static struct usb_device sim_device;
+
+static void sim_build_device(void)
+{
+	int i;
+
+	memset(&sim_device, 0, sizeof(sim_device));
+	memset(&sim_config, 0, sizeof(sim_config));
+	memset(&sim_interface, 0, sizeof(sim_interface));
+	memset(&sim_altsetting, 0, sizeof(sim_altsetting));
+	memset(sim_endpoints, 0, sizeof(sim_endpoints));
+
+	for (i = 0; i < 2; i++) {
+		sim_endpoints[i].bLength = USB_DT_ENDPOINT_SIZE;
+		sim_endpoints[i].bDescriptorType = USB_DT_ENDPOINT;
+		sim_endpoints[i].bEndpointAddress = i ? SIM_EP_IN : SIM_EP_OUT;
+		sim_endpoints[i].bmAttributes = sim.params.bmAttributes;
+		sim_endpoints[i].wMaxPacketSize = sim.params.wMaxPacketSize;
+		sim_endpoints[i].bInterval =
+			(sim.params.bmAttributes == USB_ENDPOINT_TYPE_BULK) ? 0 : 1;
+	}
+
+	sim_altsetting.bLength = USB_DT_INTERFACE_SIZE;
+	sim_altsetting.bDescriptorType = USB_DT_INTERFACE;
+	sim_altsetting.bNumEndpoints = 2;
+	sim_altsetting.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+	sim_altsetting.endpoint = sim_endpoints;
+
+	sim_interface.altsetting = &sim_altsetting;
+	sim_interface.num_altsetting = 1;
+
+	sim_config.bLength = USB_DT_CONFIG_SIZE;
+	sim_config.bDescriptorType = USB_DT_CONFIG;
+	sim_config.wTotalLength = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE +
+		(2 * USB_DT_ENDPOINT_SIZE);
+	sim_config.bNumInterfaces = 1;
+	sim_config.bConfigurationValue = 1;
+	sim_config.bmAttributes = 0x80;
+	sim_config.MaxPower = 50;
+	sim_config.interface = &sim_interface;
+
+	sim_device.descriptor.bLength = USB_DT_DEVICE_SIZE;
+	sim_device.descriptor.bDescriptorType = USB_DT_DEVICE;
+	sim_device.descriptor.bcdUSB = 0x0200;
+	sim_device.descriptor.bDeviceClass = USB_CLASS_PER_INTERFACE;
+	sim_device.descriptor.bMaxPacketSize0 = 64;
+	sim_device.descriptor.idVendor = sim.params.idVendor;
+	sim_device.descriptor.idProduct = sim.params.idProduct;
+	sim_device.descriptor.bcdDevice = 0x0100;
+	sim_device.descriptor.iManufacturer = 1;
+	sim_device.descriptor.iProduct = 2;
+	sim_device.descriptor.bNumConfigurations = 1;
+	sim_device.config = &sim_config;
+	sim_device.devnum = SIM_DEVNUM;
+	sprintf(sim_device.filename, "%03d", SIM_DEVNUM);
+}
+
+static int sim_init(const struct usb_init_params *params)
+{
+	unsigned char indexC = 0;
+	int i;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.params = params->sim;
+	if (!sim.params.idVendor)
+		sim.params.idVendor = 0x0666;
+	if (!sim.params.idProduct)
+		sim.params.idProduct = 0x0001;
+	if (!sim.params.bmAttributes)
+		sim.params.bmAttributes = USB_ENDPOINT_TYPE_BULK;
+	if (!sim.params.wMaxPacketSize)
+		sim.params.wMaxPacketSize = 512;
+	if (sim.params.bmAttributes > USB_ENDPOINT_TYPE_INTERRUPT ||
+		sim.params.latency_us < 0 || sim.params.bytes_per_sec < 0)
+		return -(errno=EINVAL);
+
+	sim.pattern = malloc(sim.params.wMaxPacketSize);
+	sim.fifo = malloc(SIM_LOOP_FIFO_SIZE);
+	if (!sim.pattern || !sim.fifo) {
+		free(sim.pattern);
+		free(sim.fifo);
+		return -(errno=ENOMEM);
+	}
+
+	/* [0][KeyByte] 2 3 4 5 ..to.. wMaxPacketSize (rolls over to 1) */
+	for (i = 0; i < sim.params.wMaxPacketSize; i++) {
+		sim.pattern[i] = indexC++;
+		if (indexC == 0) indexC = 1;
+	}
+
+	if (Mpl_Mutex_Init(&sim.lock) != MPL_SUCCESS) {
+		free(sim.pattern);
+		free(sim.fifo);
+		return -(errno=ENOMEM);
+	}
+	sim.test_type = SIM_TEST_LOOP;
+
+	sim_build_device();
+	return 0;
+}
+
+static void sim_exit(void)
+{
+	struct usb_bus *bus, *tbus;
+	struct sim_urb *urb;
+
+	/* the event thread has stopped, drop whatever is left */
+	while ((urb = sim.pending) != NULL) {
+		LIST_DEL(sim.pending, urb);
+		free(urb);
+	}
+	while ((urb = sim.free_urbs) != NULL) {
+		LIST_DEL(sim.free_urbs, urb);
+		free(urb);
+	}
+
+	/* the simulated device is not heap allocated; take it out of the bus
+	 * list before another backend gets to free it. */
+	for (bus = usb_busses; bus; bus = tbus) {
+		tbus = bus->next;
+		if (bus->devices == &sim_device) {
+			usbi_device_index_remove(&sim_device);
+			LIST_DEL(usb_busses, bus);
+			free(bus);
+		}
+	}
+
+	Mpl_Mutex_Free(&sim.lock);
+	free(sim.pattern);
+	free(sim.fifo);
+	memset(&sim, 0, sizeof(sim));
+}
+
+static int sim_find_busses(struct usb_bus **ret)
+{
+	struct usb_bus *bus;
+
+	bus = malloc(sizeof(*bus));
+	if (!bus)
+		return -ENOMEM;
+
+	memset(bus, 0, sizeof(*bus));
+	bus->location = SIM_BUS_LOCATION;
+	sprintf(bus->dirname, "%03d", SIM_BUS_LOCATION);
+	*ret = bus;
+	return 0;
+}
+
+static int sim_find_devices(void)
+{
+	struct usb_bus *bus;
+	int changes = 0;
+
+	for (bus = usb_busses; bus; bus = bus->next) {
+		if (bus->location != SIM_BUS_LOCATION || bus->devices)
+			continue;
+
+		sim_device.bus = bus;
+		if (usbi_device_index_add(&sim_device) < 0)
+			return -ENOMEM;
+		LIST_ADD(bus->devices, (&sim_device));
+		changes++;
+	}
+	return changes;
+}
+
+static int sim_open(usb_dev_handle *udev)
+{
+	return (udev->device == &sim_device) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+static void sim_close(usb_dev_handle *udev)
+{
+}
+
+static int sim_set_configuration(usb_dev_handle *udev, int configuration)
+{
+	return (configuration == -1 || configuration == 0 || configuration == 1) ?
+		0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_claim_interface(usb_dev_handle *udev, int interface)
+{
+	return interface == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_set_interface_alt_setting(usb_dev_handle *udev, int interface,
+	int alternate)
+{
+	return (interface == 0 && alternate == 0) ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_clear_halt(usb_dev_handle *udev, unsigned char ep)
+{
+	return 0;
+}
+
+static int sim_reset_device(usb_dev_handle *udev)
+{
+	return 0;
+}
+
+static int sim_kernel_driver_active(usb_dev_handle *udev, int interface)
+{
+	return 0;
+}
+
+static int sim_detach_kernel_driver(usb_dev_handle *udev, int interface)
+{
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* handles a control request; returns the data stage length or a libusb
+ * error. must hold sim.lock */
+static int sim_control(uint8_t bmRequestType, uint8_t bRequest,
+	uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength)
+{
+	int i, len;
+
+	if ((bmRequestType & (0x03 << 5)) == USB_TYPE_VENDOR) {
+		switch (bRequest) {
+		case SIM_SET_TEST:
+			sim.test_type = wValue & SIM_TEST_LOOP;
+			sim.fifo_head = sim.fifo_count = 0;
+			/* fall through */
+		case SIM_GET_TEST:
+			if (!(bmRequestType & USB_ENDPOINT_IN) || wLength < 1)
+				return 0;
+			data[0] = (unsigned char)sim.test_type;
+			return 1;
+		}
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (bRequest != USB_REQ_GET_DESCRIPTOR || !(bmRequestType & USB_ENDPOINT_IN))
+		return LIBUSB_ERROR_PIPE;
+
+	switch (wValue >> 8) {
+	case USB_DT_DEVICE:
+		len = wLength < USB_DT_DEVICE_SIZE ? wLength : USB_DT_DEVICE_SIZE;
+		memcpy(data, &sim_device.descriptor, len);
+		return len;
+	case USB_DT_STRING:
+		i = wValue & 0xff;
+		if (i == 0) {
+			unsigned char langids[4] = {4, USB_DT_STRING, 0x09, 0x04};
+			len = wLength < 4 ? wLength : 4;
+			memcpy(data, langids, len);
+			return len;
+		}
+		if (i >= (int)(sizeof(sim_strings) / sizeof(sim_strings[0])))
+			return LIBUSB_ERROR_PIPE;
+		len = 2 + 2 * (int)strlen(sim_strings[i]);
+		if (len > wLength)
+			len = wLength & ~1;
+		if (len >= 2) {
+			data[0] = (unsigned char)(2 + 2 * strlen(sim_strings[i]));
+			data[1] = USB_DT_STRING;
+		}
+		for (i = 2; i < len; i += 2) {
+			data[i] = sim_strings[wValue & 0xff][(i - 2) / 2];
+			data[i + 1] = 0;
+		}
+		return len;
+	}
+	return LIBUSB_ERROR_PIPE;
+}
+
+static void sim_fill_pattern(unsigned char *data, int length)
+{
+	int pkt;
+
+	while (length > 0) {
+		pkt = length < sim.params.wMaxPacketSize ? length : sim.params.wMaxPacketSize;
+		memcpy(data, sim.pattern, pkt);
+		if (pkt > 1)
+			data[1] = sim.key++;
+		data += pkt;
+		length -= pkt;
+	}
+}
+
+static int sim_fifo_write(const unsigned char *data, int length)
+{
+	int written = 0;
+
+	while (written < length && sim.fifo_count < SIM_LOOP_FIFO_SIZE) {
+		int tail = (sim.fifo_head + sim.fifo_count) % SIM_LOOP_FIFO_SIZE;
+		int chunk = SIM_LOOP_FIFO_SIZE - sim.fifo_count;
+		if (chunk > SIM_LOOP_FIFO_SIZE - tail)
+			chunk = SIM_LOOP_FIFO_SIZE - tail;
+		if (chunk > length - written)
+			chunk = length - written;
+		memcpy(sim.fifo + tail, data + written, chunk);
+		sim.fifo_count += chunk;
+		written += chunk;
+	}
+	return written;
+}
+
+static int sim_fifo_read(unsigned char *data, int length)
+{
+	int read = 0;
+
+	while (read < length && sim.fifo_count > 0) {
+		int chunk = sim.fifo_count;
+		if (chunk > SIM_LOOP_FIFO_SIZE - sim.fifo_head)
+			chunk = SIM_LOOP_FIFO_SIZE - sim.fifo_head;
+		if (chunk > length - read)
+			chunk = length - read;
+		memcpy(data + read, sim.fifo + sim.fifo_head, chunk);
+		sim.fifo_head = (sim.fifo_head + chunk) % SIM_LOOP_FIFO_SIZE;
+		sim.fifo_count -= chunk;
+		read += chunk;
+	}
+	return read;
+}
+
+/* moves the data of a due urb; returns 1 once it is finished. must hold
+ * sim.lock */
+static int sim_urb_data(struct sim_urb *urb)
+{
+	int in = urb->endpoint & USB_ENDPOINT_IN;
+	int i;
+
+	switch (urb->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+	{
+		struct libusb_control_setup *setup = (struct libusb_control_setup *)urb->buffer;
+		int r = sim_control(setup->bmRequestType, setup->bRequest,
+			USB_LE16_TO_CPU(setup->wValue), USB_LE16_TO_CPU(setup->wIndex),
+			urb->buffer + LIBUSB_CONTROL_SETUP_SIZE, USB_LE16_TO_CPU(setup->wLength));
+		if (r < 0) {
+			urb->status = LIBUSB_TRANSFER_STALL;
+		} else {
+			urb->actual_length = r;
+			urb->status = LIBUSB_TRANSFER_COMPLETED;
+		}
+		return 1;
+	}
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+	{
+		struct libusb_transfer *transfer = urb->transfer;
+		unsigned char *data = urb->buffer;
+		for (i = 0; transfer && i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+			if (in)
+				sim_fill_pattern(data, desc->length);
+			desc->actual_length = desc->length;
+			desc->status = LIBUSB_TRANSFER_COMPLETED;
+			data += desc->length;
+		}
+		urb->status = LIBUSB_TRANSFER_COMPLETED;
+		return 1;
+	}
+	}
+
+	if (sim.test_type == SIM_TEST_LOOP) {
+		if (in) {
+			urb->actual_length = sim_fifo_read(urb->buffer, urb->length);
+			if (!urb->actual_length && urb->length)
+				return 0;
+		} else {
+			urb->actual_length += sim_fifo_write(urb->buffer + urb->actual_length,
+				urb->length - urb->actual_length);
+			if (urb->actual_length < urb->length)
+				return 0;
+		}
+	} else {
+		if (in)
+			sim_fill_pattern(urb->buffer, urb->length);
+		urb->actual_length = urb->length;
+	}
+
+	urb->status = LIBUSB_TRANSFER_COMPLETED;
+	return 1;
+}
+
+/* wakes every thread waiting in sim_run(). must hold sim.lock */
+static void sim_wake(void)
+{
+	struct sim_waiter *waiter;
+
+	for (waiter = sim.waiters; waiter; waiter = waiter->next)
+		Mpl_Event_Set(&waiter->event);
+}
+
+/* queues an urb behind the ones already pending on its direction. must hold
+ * sim.lock */
+static void sim_urb_queue(struct sim_urb *urb, unsigned int timeout)
+{
+	int dir = (urb->endpoint & USB_ENDPOINT_IN) ? 1 : 0;
+	muint64_t now = Mpl_Clock_Ticks_Us();
+	muint64_t start = sim.busy_until_us[dir] > now ? sim.busy_until_us[dir] : now;
+
+	if (sim.params.bytes_per_sec)
+		start += ((muint64_t)urb->length * 1000000) / sim.params.bytes_per_sec;
+	sim.busy_until_us[dir] = start;
+
+	urb->due_us = start + sim.params.latency_us;
+	urb->deadline_us = timeout ? now + ((muint64_t)timeout * 1000) : 0;
+	urb->status = LIBUSB_TRANSFER_ERROR;
+	urb->actual_length = 0;
+	urb->cancelled = 0;
+	urb->done = 0;
+
+	urb->next = NULL;
+	urb->prev = sim.pending_tail;
+	if (sim.pending_tail)
+		sim.pending_tail->next = urb;
+	else
+		sim.pending = urb;
+	sim.pending_tail = urb;
+
+	sim_wake();
+}
+
+static void sim_urb_unlink(struct sim_urb *urb)
+{
+	if (sim.pending_tail == urb)
+		sim.pending_tail = urb->prev;
+	LIST_DEL(sim.pending, urb);
+}
+
+/*
+ * Finishes every urb that is due at 'now'. Urbs on an endpoint complete in
+ * the order they were submitted. Finished async urbs are appended to
+ * 'completed', so their callbacks run in submission order as with libusb;
+ * finished sync urbs are flagged done. Returns the time of the
+ * next pending event, or 0 if nothing is scheduled. must hold sim.lock
+ */
+static muint64_t sim_process(muint64_t now, struct sim_urb **completed)
+{
+	struct sim_urb *urb, *next, *tail = NULL;
+	muint64_t next_event;
+	unsigned int blocked;
+	int fifo_count;
+	int finished;
+
+	do {
+		fifo_count = sim.fifo_count;
+		next_event = 0;
+		blocked = 0;
+
+		for (urb = sim.pending; urb; urb = next) {
+			unsigned int ep_bit = 1u << ((urb->endpoint & 0x0f) |
+				((urb->endpoint & USB_ENDPOINT_IN) ? 0x10 : 0));
+			next = urb->next;
+
+			if (urb->cancelled) {
+				urb->status = LIBUSB_TRANSFER_CANCELLED;
+				finished = 1;
+			} else if (urb->deadline_us && urb->deadline_us <= now) {
+				urb->status = LIBUSB_TRANSFER_TIMED_OUT;
+				finished = 1;
+			} else if (blocked & ep_bit) {
+				finished = 0;
+			} else if (urb->due_us > now) {
+				if (!next_event || urb->due_us < next_event)
+					next_event = urb->due_us;
+				finished = 0;
+			} else {
+				finished = sim_urb_data(urb);
+			}
+
+			if (!finished) {
+				blocked |= ep_bit;
+				if (urb->deadline_us && (!next_event || urb->deadline_us < next_event))
+					next_event = urb->deadline_us;
+				continue;
+			}
+
+			sim_urb_unlink(urb);
+			urb->done = 1;
+			if (urb->transfer) {
+				urb->transfer->status = urb->status;
+				urb->transfer->actual_length = urb->actual_length;
+				urb->next = NULL;
+				urb->prev = tail;
+				if (tail)
+					tail->next = urb;
+				else
+					*completed = urb;
+				tail = urb;
+			}
+		}
+	/* loop data moved; a blocked urb on the other direction may be able to
+	 * continue now */
+	} while (fifo_count != sim.fifo_count);
+
+	return next_event;
+}
+
+/*
+ * Waits for the next event, a sim_wake() or until 'until_us'. Without a
+ * waiter, because its event could not be set up, it only sleeps until the
+ * next event. must hold sim.lock
+ */
+static void sim_wait(struct sim_waiter *waiter, muint64_t next_event, muint64_t until_us)
+{
+	muint64_t now = Mpl_Clock_Ticks_Us();
+	muint64_t wait_us;
+
+	if (next_event && next_event < until_us)
+		until_us = next_event;
+	if (until_us <= now)
+		return;
+	wait_us = until_us - now;
+
+	if (!waiter) {
+		Mpl_Mutex_Release(&sim.lock);
+		MPL_SleepUs((unsigned int)(wait_us < 1000 ? wait_us : 1000));
+		Mpl_Mutex_Wait(&sim.lock);
+		return;
+	}
+
+	/* a wake between here and the wait leaves the event set */
+	LIST_ADD(sim.waiters, waiter);
+	Mpl_Mutex_Release(&sim.lock);
+	Mpl_Event_Wait_Us(&waiter->event, (mint64_t)wait_us);
+	Mpl_Mutex_Wait(&sim.lock);
+	LIST_DEL(sim.waiters, waiter);
+}
+
+/*
+ * Runs the simulator for at most timeout_us. If 'done' is set, returns as
+ * soon as it is nonzero, otherwise as soon as any async transfer has
+ * completed. Transfer callbacks are invoked without the lock held.
+ */
+static void sim_run(int *done, muint64_t timeout_us)
+{
+	struct sim_urb *completed, *urb;
+	struct sim_waiter waiter, *wait_on = NULL;
+	muint64_t end_us, now, next_event;
+
+	Mpl_Mutex_Wait(&sim.lock);
+	end_us = Mpl_Clock_Ticks_Us() + timeout_us;
+
+	for (;;) {
+		now = Mpl_Clock_Ticks_Us();
+		completed = NULL;
+		next_event = sim_process(now, &completed);
+
+		if (completed) {
+			/* wake sync callers whose urbs were finished here */
+			sim_wake();
+			Mpl_Mutex_Release(&sim.lock);
+			for (urb = completed; urb; urb = urb->next)
+				urb->transfer->callback(urb->transfer);
+			Mpl_Mutex_Wait(&sim.lock);
+			while ((urb = completed) != NULL) {
+				LIST_DEL(completed, urb);
+				LIST_ADD(sim.free_urbs, urb);
+			}
+			/* the callbacks may have set the 'done' flag of another thread */
+			sim_wake();
+			if (!done)
+				break;
+			continue;
+		}
+
+		if ((done && *done) || now >= end_us)
+			break;
+		if (!wait_on) {
+			memset(&waiter, 0, sizeof(waiter));
+			if (Mpl_Event_Init(&waiter.event, 1, 0) == MPL_SUCCESS)
+				wait_on = &waiter;
+		}
+		sim_wait(wait_on, next_event, end_us);
+	}
+
+	if (done && *done)
+		sim_wake();
+	Mpl_Mutex_Release(&sim.lock);
+
+	if (wait_on)
+		Mpl_Event_Free(&waiter.event);
+}
+
+static int sim_sync_transfer(unsigned char type, unsigned char ep,
+	unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+	struct sim_urb urb;
+
+	memset(&urb, 0, sizeof(urb));
+	urb.endpoint = ep;
+	urb.type = type;
+	urb.buffer = data;
+	urb.length = length;
+
+	Mpl_Mutex_Wait(&sim.lock);
+	sim_urb_queue(&urb, timeout);
+	Mpl_Mutex_Release(&sim.lock);
+
+	while (!urb.done)
+		sim_run(&urb.done, 1000000);
+
+	*actual_length = urb.actual_length;
+	switch (urb.status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	}
+	return LIBUSB_ERROR_IO;
+}
+
+static int sim_control_transfer(usb_dev_handle *udev, uint8_t bmRequestType,
+	uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data,
+	uint16_t wLength, unsigned int timeout)
+{
+	int r;
+
+	if (sim.params.latency_us)
+		MPL_SleepUs(sim.params.latency_us);
+
+	Mpl_Mutex_Wait(&sim.lock);
+	r = sim_control(bmRequestType, bRequest, wValue, wIndex, data, wLength);
+	Mpl_Mutex_Release(&sim.lock);
+	return r;
+}
+
+static int sim_bulk_transfer(usb_dev_handle *udev, unsigned char ep,
+	unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+	return sim_sync_transfer(LIBUSB_TRANSFER_TYPE_BULK, ep, data, length,
+		actual_length, timeout);
+}
+
+static int sim_interrupt_transfer(usb_dev_handle *udev, unsigned char ep,
+	unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+	return sim_sync_transfer(LIBUSB_TRANSFER_TYPE_INTERRUPT, ep, data, length,
+		actual_length, timeout);
+}
+
+static int sim_get_string_descriptor_ascii(usb_dev_handle *udev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	const char *str;
+	int len;
+
+	if (desc_index == 0 ||
+		desc_index >= sizeof(sim_strings) / sizeof(sim_strings[0]))
+		return LIBUSB_ERROR_PIPE;
+	if (length < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	str = sim_strings[desc_index];
+	len = (int)strlen(str);
+	if (len > length - 1)
+		len = length - 1;
+	memcpy(data, str, len);
+	data[len] = 0;
+	return len;
+}
+
+static int sim_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct sim_urb *urb;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL &&
+		(transfer->endpoint & 0x7f) != (SIM_EP_OUT & 0x7f))
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL &&
+		transfer->length < LIBUSB_CONTROL_SETUP_SIZE)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	Mpl_Mutex_Wait(&sim.lock);
+	if ((urb = sim.free_urbs) != NULL) {
+		LIST_DEL(sim.free_urbs, urb);
+	} else if ((urb = malloc(sizeof(*urb))) == NULL) {
+		Mpl_Mutex_Release(&sim.lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	memset(urb, 0, sizeof(*urb));
+
+	urb->transfer = transfer;
+	urb->endpoint = transfer->endpoint;
+	urb->type = transfer->type;
+	urb->buffer = transfer->buffer;
+	urb->length = transfer->length;
+	if (urb->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		/* the control setup always goes out first */
+		struct libusb_control_setup *setup = (struct libusb_control_setup *)transfer->buffer;
+		urb->endpoint = setup->bmRequestType & USB_ENDPOINT_IN;
+	}
+	sim_urb_queue(urb, transfer->timeout);
+	Mpl_Mutex_Release(&sim.lock);
+	return 0;
+}
+
+static int sim_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct sim_urb *urb;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	Mpl_Mutex_Wait(&sim.lock);
+	for (urb = sim.pending; urb; urb = urb->next) {
+		if (urb->transfer == transfer) {
+			urb->cancelled = 1;
+			sim_wake();
+			r = 0;
+			break;
+		}
+	}
+	Mpl_Mutex_Release(&sim.lock);
+	return r;
+}
+
+/* The simulator does not need an events lock; any number of threads can
+ * process events at the same time. */
+static void sim_lock_events(void)
+{
+}
+
+static void sim_unlock_events(void)
+{
+}
+
+static int sim_event_handling_ok(void)
+{
+	return 1;
+}
+
+static int sim_handle_events_locked(struct timeval *tv)
+{
+	sim_run(NULL, ((muint64_t)tv->tv_sec * 1000000) + tv->tv_usec);
+	return 0;
+}
+
+static int sim_handle_events_completed(struct timeval *tv, int *completed)
+{
+	sim_run(completed, ((muint64_t)tv->tv_sec * 1000000) + tv->tv_usec);
+	return 0;
+}
+
+/* The simulator has no fds; its events are purely timed */
+static int sim_get_pollfds(struct usb_pollfd *fds, int max)
+{
+	return 0;
+}
+
+static int sim_get_next_timeout(struct timeval *tv)
+{
+	struct sim_urb *urb;
+	muint64_t now, next_event = 0;
+
+	Mpl_Mutex_Wait(&sim.lock);
+	now = Mpl_Clock_Ticks_Us();
+	for (urb = sim.pending; urb; urb = urb->next) {
+		muint64_t t = urb->cancelled ? now : urb->due_us;
+
+		if (urb->deadline_us && urb->deadline_us < t)
+			t = urb->deadline_us;
+		if (!next_event || t < next_event)
+			next_event = t;
+	}
+	Mpl_Mutex_Release(&sim.lock);
+
+	if (!next_event)
+		return 0;
+	next_event = next_event > now ? next_event - now : 0;
+	tv->tv_sec = (long)(next_event / 1000000);
+	tv->tv_usec = (long)(next_event % 1000000);
+	return 1;
+}
+
+/* the simulated device has no kernel memory to map; buffers come from the
+ * heap */
+static void *sim_dev_mem_alloc(usb_dev_handle *udev, size_t size)
+{
+	return NULL;
+}
+
+static void sim_dev_mem_free(usb_dev_handle *udev, void *buffer, size_t size)
+{
+}
+
+const struct usbi_backend usbi_sim_backend = {
+	"simulated",
+	sim_init,
+	sim_exit,
+	sim_find_busses,
+	sim_find_devices,
+	sim_open,
+	sim_close,
+	sim_set_configuration,
+	sim_claim_interface,
+	sim_claim_interface,
+	sim_set_interface_alt_setting,
+	sim_clear_halt,
+	sim_reset_device,
+	sim_kernel_driver_active,
+	sim_detach_kernel_driver,
+	sim_control_transfer,
+	sim_bulk_transfer,
+	sim_interrupt_transfer,
+	sim_get_string_descriptor_ascii,
+	sim_submit_transfer,
+	sim_cancel_transfer,
+	sim_lock_events,
+	sim_unlock_events,
+	sim_event_handling_ok,
+	sim_handle_events_locked,
+	sim_handle_events_completed,
+	sim_get_pollfds,
+	sim_get_next_timeout,
+	sim_dev_mem_alloc,
+	sim_dev_mem_free,
+};
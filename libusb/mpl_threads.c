@@ -1,5 +1,14 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+#endif
 #include "mpl_threads.h"
 
+#ifdef MPL_EVENT_FUTEX
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 #define ErrNo_To_Mpl(mResult)								\
 	if ((mResult) == 0)										\
 		(mResult) = MPL_SUCCESS;							\
@@ -53,6 +62,27 @@ void Mpl_Thread_End(void* ret_val)
 	pthread_exit(ret_val);
 }
 
+int Mpl_Thread_SetAffinity(MPL_THREAD_T* thread_handle, muint64_t cpu_mask)
+{
+#if MPL_OS_TYPE == MPL_OS_TYPE_LINUX
+	int r, cpu;
+	cpu_set_t cpus;
+
+	if (!thread_handle || !cpu_mask) return MPL_FAIL;
+
+	CPU_ZERO(&cpus);
+	for (cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++)
+		if (cpu_mask & ((muint64_t)1 << cpu))
+			CPU_SET(cpu, &cpus);
+	r = pthread_setaffinity_np(thread_handle->Handle, sizeof(cpus), &cpus);
+	ErrNo_To_Mpl(r);
+	return r;
+#else
+	/* OS X only supports affinity hints between threads */
+	return MPL_FAIL;
+#endif
+}
+
 int Mpl_Mutex_Init(MPL_MUTEX_T* mutex_handle)
 {
 	int r = 0;
@@ -113,6 +143,110 @@ int Mpl_Mutex_Release(MPL_MUTEX_T* mutex_handle)
 	return r;
 }
 
+#ifdef MPL_EVENT_FUTEX
+
+static int futex_wait(volatile int* addr, int val, const struct timespec* abstime)
+{
+	/* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline */
+	return (int)syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake(volatile int* addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int Mpl_Event_Init(MPL_EVENT_T* event_handle, int is_auto_reset, int initial_state)
+{
+	if (!event_handle || event_handle->Common.Valid) return MPL_FAIL;
+
+	event_handle->IsAuto = is_auto_reset;
+	event_handle->IsSet = initial_state ? 1 : 0;
+	event_handle->Waiters = 0;
+	event_handle->Common.Valid = MPT_VALID;
+	return MPL_SUCCESS;
+}
+
+int Mpl_Event_Free(MPL_EVENT_T* event_handle)
+{
+	if (!event_handle || event_handle->Common.Valid != MPT_VALID) return MPL_FAIL;
+	event_handle->Common.Valid = 0;
+	return MPL_SUCCESS;
+}
+
+int Mpl_Event_Wait_Us(MPL_EVENT_T* event_handle, mint64_t rel_microseconds)
+{
+	struct timespec abstime;
+	int r;
+
+	if (!event_handle) return MPL_FAIL;
+
+	if (rel_microseconds > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &abstime);
+		Mpl_Clock_AddUs(&abstime, rel_microseconds);
+	}
+
+	for (;;)
+	{
+		if (event_handle->IsAuto)
+		{
+			if (MPL_Atomic_CmpExg32(&event_handle->IsSet, 0, 1)) return MPL_SUCCESS;
+		}
+		else if (event_handle->IsSet)
+		{
+			return MPL_SUCCESS;
+		}
+		if (rel_microseconds == 0) return MPL_TIMEOUT;
+
+		/* Waiters is raised before the futex re-checks IsSet, so a
+		 * concurrent Mpl_Event_Set() either sees it or the wait returns
+		 * EAGAIN */
+		MPL_Atomic_Inc32(&event_handle->Waiters);
+		r = futex_wait(&event_handle->IsSet, 0, rel_microseconds > 0 ? &abstime : NULL);
+		if (r == -1) r = errno;
+		MPL_Atomic_Dec32(&event_handle->Waiters);
+
+		if (r == ETIMEDOUT)
+		{
+			/* a set may have raced with the deadline */
+			if (event_handle->IsAuto)
+				return MPL_Atomic_CmpExg32(&event_handle->IsSet, 0, 1) ? MPL_SUCCESS : MPL_TIMEOUT;
+			return event_handle->IsSet ? MPL_SUCCESS : MPL_TIMEOUT;
+		}
+		if (r != 0 && r != EAGAIN && r != EINTR) return MPL_FAIL;
+	}
+}
+
+int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
+{
+	return Mpl_Event_Wait_Us(event_handle, rel_milliseconds > 0 ? (mint64_t)rel_milliseconds * 1000 : rel_milliseconds);
+}
+
+int Mpl_Event_Set(MPL_EVENT_T* event_handle)
+{
+	if (!event_handle) return MPL_FAIL;
+
+	if (!event_handle->IsSet && MPL_Atomic_CmpExg32(&event_handle->IsSet, 1, 0) && event_handle->Waiters)
+	{
+		futex_wake(&event_handle->IsSet, event_handle->IsAuto ? 1 : INT_MAX);
+	}
+	return MPL_SUCCESS;
+}
+
+int Mpl_Event_Reset(MPL_EVENT_T* event_handle)
+{
+	if (!event_handle) return MPL_FAIL;
+
+	/* the exchange is a full barrier, so loads after a reset that clears
+	 * the event are not hoisted above it. A clear event has no store to
+	 * order: a Set after the check leaves it set for the next wait */
+	if (event_handle->IsSet) (void)MPL_Atomic_CmpExg32(&event_handle->IsSet, 0, 1);
+	return MPL_SUCCESS;
+}
+
+#else /* MPL_EVENT_FUTEX */
+
 int Mpl_Event_Init(MPL_EVENT_T* event_handle, int is_auto_reset, int initial_state)
 {
 	int r = 0;
@@ -156,7 +290,7 @@ Error:
 	return r;
 }
 
-int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
+int Mpl_Event_Wait_Us(MPL_EVENT_T* event_handle, mint64_t rel_microseconds)
 {
 	int r = 0;
 	struct timespec abstime;
@@ -168,9 +302,10 @@ int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
 		if (event_handle->IsSet) return MPL_SUCCESS;
 	}
 
-	if (rel_milliseconds > 0)
+	if (rel_microseconds > 0)
 	{
-		Mpl_Clock_GetTime(&abstime, rel_milliseconds);
+		Mpl_Clock_GetTime(&abstime, 0);
+		Mpl_Clock_AddUs(&abstime, rel_microseconds);
 	}
 	if ((r = pthread_mutex_lock(&event_handle->Handle)) == 0)
 	{
@@ -183,12 +318,12 @@ int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
 			pthread_mutex_unlock(&event_handle->Handle);
 			return MPL_SUCCESS;
 		}
-		if (rel_milliseconds > 0)
+		if (rel_microseconds > 0)
 		{
 			while ((r = pthread_cond_timedwait(&event_handle->Cond, &event_handle->Handle, &abstime)) == 0 && !event_handle->IsSet);
 			ErrNo_To_Mpl(r);
 		}
-		else if (rel_milliseconds < 0)
+		else if (rel_microseconds < 0)
 		{
 			while ((r = pthread_cond_wait(&event_handle->Cond, &event_handle->Handle)) == 0 && !event_handle->IsSet);
 			ErrNo_To_Mpl(r);
@@ -211,6 +346,11 @@ int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
 	return r;
 }
 
+int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
+{
+	return Mpl_Event_Wait_Us(event_handle, rel_milliseconds > 0 ? (mint64_t)rel_milliseconds * 1000 : rel_milliseconds);
+}
+
 int Mpl_Event_Set(MPL_EVENT_T* event_handle)
 {
 	int r = 0;
@@ -260,6 +400,8 @@ int Mpl_Event_Reset(MPL_EVENT_T* event_handle)
 	return MPL_SUCCESS;
 }
 
+#endif /* MPL_EVENT_FUTEX */
+
 int Mpl_Sem_Init(MPL_SEM_T* sem_handle, int sem_value)
 {
 	int r = 0;
@@ -378,6 +520,16 @@ void Mpl_Thread_End(void* ret_val)
 	_endthreadex((UINT_PTR)ret_val);
 }
 
+int Mpl_Thread_SetAffinity(MPL_THREAD_T* thread_handle, muint64_t cpu_mask)
+{
+	if (!thread_handle || !(DWORD_PTR)cpu_mask) return MPL_FAIL;
+
+	if (SetThreadAffinityMask(thread_handle->Handle, (DWORD_PTR)cpu_mask))
+		return MPL_SUCCESS;
+
+	return MPL_FAIL;
+}
+
 int Mpl_Mutex_Init(MPL_MUTEX_T* mutex_handle)
 {
 	if (!mutex_handle || mutex_handle->Common.Valid) return MPL_FAIL;
@@ -447,6 +599,14 @@ int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds)
 	return MPL_ABANDONED;
 }
 
+/* waits are in whole milliseconds; shorter ones are rounded up */
+int Mpl_Event_Wait_Us(MPL_EVENT_T* event_handle, mint64_t rel_microseconds)
+{
+	if (rel_microseconds > 0)
+		return Mpl_Event_Wait(event_handle, (int)((rel_microseconds + 999) / 1000));
+	return Mpl_Event_Wait(event_handle, rel_microseconds < 0 ? INFINITE : 0);
+}
+
 int Mpl_Event_Set(MPL_EVENT_T* event_handle)
 {
 	if (!event_handle || !event_handle->Common.Valid) return MPL_FAIL;
@@ -638,6 +798,21 @@ void Mpl_Clock_AddMs(struct timespec* abstime, int ms_delta)
 	}
 }
 
+void Mpl_Clock_AddUs(struct timespec* abstime, mint64_t us_delta)
+{
+	if (us_delta == 0) return;
+
+	abstime->tv_sec += (time_t)(us_delta / 1000000);
+	abstime->tv_nsec += (long)((us_delta % 1000000) * 1000);
+	if (abstime->tv_nsec < 0) {
+		abstime->tv_sec -= 1;
+		abstime->tv_nsec+= 1000000000;
+	} else if (abstime->tv_nsec >= 1000000000) {
+		abstime->tv_sec += 1;
+		abstime->tv_nsec-= 1000000000;
+	}
+}
+
 double Mpl_Clock_Ticks(void)
 {
 	double tickTime;
@@ -35,6 +35,7 @@
 #  define MPL_FORCE_PTHREADS 1
 #  include <stdio.h>
 #  include <unistd.h>
+#  include <sched.h>
 #  include <stdlib.h>
 #  include <stdint.h>
 #  include <libkern/OSAtomic.h>
@@ -50,6 +51,8 @@
 #    define INFINITE (0xFFFFFFFF)
 #  endif
 #  define MPL_SleepMs(mValue) usleep((mValue)*1000)
+#  define MPL_SleepUs(mValue) usleep(mValue)
+#  define MPL_Yield() sched_yield()
 
 #elif defined(_WIN32)
 /* WINDOWS */
@@ -65,6 +68,8 @@
 #    define muint64_t unsigned __int64
 #  endif
 #  define MPL_SleepMs(mValue) Sleep(mValue)
+#  define MPL_SleepUs(mValue) Sleep(((mValue) + 999) / 1000)
+#  define MPL_Yield() SwitchToThread()
 
 #  ifndef HAVE_STRUCT_TIMESPEC
 #  define HAVE_STRUCT_TIMESPEC 1
@@ -84,6 +89,7 @@ struct timespec
 #  define MPL_FORCE_PTHREADS 1
 #  include <stdio.h>
 #  include <unistd.h>
+#  include <sched.h>
 #  include <stdlib.h>
 #  include <stdint.h>
 #  include <string.h>
@@ -102,6 +108,8 @@ struct timespec
 #    define FALSE (0)
 #  endif
 #  define MPL_SleepMs(mValue) usleep((mValue)*1000)
+#  define MPL_SleepUs(mValue) usleep(mValue)
+#  define MPL_Yield() sched_yield()
 #endif
 
 /* Atomic ops macros:
@@ -216,6 +224,19 @@ struct _MPL_MUTEX_T
 	MPL_COMMON_T Common;
 	pthread_mutex_t Handle;
 };
+#  if MPL_OS_TYPE == MPL_OS_TYPE_LINUX && defined(__linux__)
+/* events are a futex word; set/wait only enter the kernel to sleep or to
+ * wake a sleeper */
+#    define MPL_EVENT_FUTEX 1
+struct _MPL_EVENT_T
+{
+	MPL_COMMON_T Common;
+	int IsAuto;
+
+	volatile int IsSet;
+	volatile int Waiters;
+};
+#  else
 struct _MPL_EVENT_T
 {
 	MPL_COMMON_T Common;
@@ -225,6 +246,7 @@ struct _MPL_EVENT_T
 	volatile long IsSet;
 	pthread_cond_t Cond;
 };
+#  endif
 struct _MPL_SEM_T
 {
 	MPL_COMMON_T Common;
@@ -258,6 +280,7 @@ void Mpl_Free(void);
 
 int Mpl_Thread_Init(MPL_THREAD_T* thread_handle, MPL_THREAD_PROC_T* start_fn, void* start_arg);
 void Mpl_Thread_End(void* ret_val);
+int Mpl_Thread_SetAffinity(MPL_THREAD_T* thread_handle, muint64_t cpu_mask);
 
 int Mpl_Mutex_Init(MPL_MUTEX_T* mutex_handle);
 int Mpl_Mutex_Free(MPL_MUTEX_T* mutex_handle);
@@ -268,6 +291,7 @@ int Mpl_Mutex_Release(MPL_MUTEX_T* mutex_handle);
 int Mpl_Event_Init(MPL_EVENT_T* event_handle, int is_auto_reset, int initial_state);
 int Mpl_Event_Free(MPL_EVENT_T* event_handle);
 int Mpl_Event_Wait(MPL_EVENT_T* event_handle, int rel_milliseconds);
+int Mpl_Event_Wait_Us(MPL_EVENT_T* event_handle, mint64_t rel_microseconds);
 int Mpl_Event_Set(MPL_EVENT_T* event_handle);
 int Mpl_Event_Reset(MPL_EVENT_T* event_handle);
 
@@ -280,6 +304,7 @@ int Mpl_Sem_GetCount(MPL_SEM_T* sem_handle, volatile long* sem_value);
 
 void Mpl_Clock_GetTime(struct timespec* abstime, int ms_add_delta);
 void Mpl_Clock_AddMs(struct timespec* abstime, int ms_delta);
+void Mpl_Clock_AddUs(struct timespec* abstime, mint64_t us_delta);
 
 double Mpl_Clock_Ticks(void);
 muint64_t Mpl_Clock_Ticks_Ms(void);
@@ -431,6 +431,85 @@ typedef struct usb_dev_handle usb_dev_handle;
 #include <poppack.h>
 #endif
 
+/*
+ * Backends for usb_initex(). USB_BACKEND_SIMULATED emulates a benchmark
+ * firmware device in-process so the transfer paths can be exercised on
+ * machines without USB hardware.
+ */
+#define USB_BACKEND_LIBUSB10		0
+#define USB_BACKEND_SIMULATED		1
+
+/* Simulated benchmark device. Zeroed members select the defaults. */
+struct usb_sim_params
+{
+	uint16_t idVendor;		/* Default=0x0666 */
+	uint16_t idProduct;		/* Default=0x0001 */
+	uint8_t  bmAttributes;		/* Endpoint type. Default=USB_ENDPOINT_TYPE_BULK */
+	uint16_t wMaxPacketSize;	/* Default=512 */
+	int latency_us;			/* Added to the completion time of each transfer */
+	int bytes_per_sec;		/* Per direction. 0=unlimited */
+};
+
+/*
+ * Optional parameters for usb_initex(). Set size to
+ * sizeof(struct usb_init_params); members beyond size are treated as zero.
+ */
+struct usb_init_params
+{
+	int size;
+	int backend;			/* USB_BACKEND_ */
+	struct usb_sim_params sim;
+
+	/* if non-zero, the async event handling thread is pinned to the cpus
+	 * set in this mask. There is one such thread: libusb runs completion
+	 * callbacks under its events lock, so more threads would not complete
+	 * transfers any faster. */
+	uint64_t event_cpu_mask;
+
+	/* if non-zero and supported, usb_find_busses() and usb_find_devices()
+	 * apply libusb hotplug arrivals and departures instead of rescanning */
+	int hotplug;
+
+	/* if non-zero, handles keep the statistics returned by
+	 * usb_get_endpoint_stats() */
+	int endpoint_stats;
+
+	/* if non-zero, no event threads are started and completions are only
+	 * processed by usb_handle_events() and by calls that wait for them,
+	 * such as usb_reap_async(); see usb_get_pollfds() */
+	int external_events;
+
+	/* if non-zero, usb_close() cancels the async transfers still in
+	 * flight on the handle and waits for them, see usb_cancel_endpoint() */
+	int drain_on_close;
+
+	/* if non-zero, the synchronous bulk, interrupt and control calls are
+	 * completed by the async event threads instead of handling events on
+	 * the calling thread; they must not be made from a completion
+	 * callback */
+	int sync_through_async;
+};
+
+/* Endpoint statistics
+ * Latencies are counted in log-linear histograms over microseconds;
+ * usb_stats_bucket_us() returns the lower bound of a bucket.
+ * complete_hist holds the time from submit to completion (the whole call
+ * for synchronous transfers), reap_hist the time from completion until an
+ * async transfer was reaped. Control transfers are counted on endpoint 0.
+ */
+#define USB_STATS_BUCKETS 124
+
+struct usb_endpoint_stats
+{
+	uint64_t transfers;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t cancelled;		/* cancelled async transfers */
+	uint32_t complete_hist[USB_STATS_BUCKETS];
+	uint32_t reap_hist[USB_STATS_BUCKETS];
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -475,16 +554,300 @@ int USBAPI_DECL usb_find_devices(void);
 struct usb_device* USBAPI_DECL usb_device(usb_dev_handle *dev);
 struct usb_bus* USBAPI_DECL usb_get_busses(void);
 
+/* O(1) lookups over the devices found by usb_find_devices(). index selects
+ * the n-th device with the given ids. Return NULL if there is no match. */
+struct usb_device* USBAPI_DECL usb_find_device_by_addr(int bus_num, int devnum);
+struct usb_device* USBAPI_DECL usb_find_device_by_id(int vid, int pid, int index);
+
 /* Asynchronous I/O */
 int USBAPI_DECL usb_isochronous_setup_async(usb_dev_handle *dev, void **context, unsigned char ep, int pktsize);
 int USBAPI_DECL usb_bulk_setup_async(usb_dev_handle *dev, void **context, unsigned char ep);
 int USBAPI_DECL usb_interrupt_setup_async(usb_dev_handle *dev, void **context, unsigned char ep);
 int USBAPI_DECL usb_submit_async(void *context, char *bytes, int size);
+/* As usb_submit_async(), but the transfer is completed with -ETIMEDOUT
+ * after timeout ms (0 waits forever). Data transferred before the
+ * timeout is kept, and the reap result is then its length. */
+int USBAPI_DECL usb_submit_async_timeout(void *context, char *bytes, int size, int timeout);
 int USBAPI_DECL usb_reap_async(void *context, int timeout);
 int USBAPI_DECL usb_reap_async_nocancel(void *context, int timeout);
 int USBAPI_DECL usb_cancel_async(void *context);
 int USBAPI_DECL usb_free_async(void **context);
 
+/* Cancels every async transfer in flight on endpoint ep of dev, or on all
+ * endpoints if ep is negative, and waits until all of them have completed
+ * and been handed back: completion callbacks have returned and queued
+ * completions are in their queues. The contexts are then idle; they can
+ * be reaped or freed. Bulk streams are covered; isochronous streams and
+ * interrupt pollers are not and are stopped by closing them, and
+ * usb_bulk_readv()/usb_bulk_writev() return on their own timeout.
+ * Not to be called from a completion callback, which would wait for
+ * itself.
+ */
+int USBAPI_DECL usb_cancel_endpoint(usb_dev_handle *dev, int ep);
+
+/* Asynchronous control transfers
+ * The buffer passed to usb_submit_async() for a context from
+ * usb_control_setup_async() starts with the USB_CONTROL_SETUP_SIZE byte
+ * setup packet, written by usb_control_fill_setup(), and is followed by
+ * the data stage of size bytes. The reap result is the number of data
+ * stage bytes transferred; IN data is returned after the setup packet.
+ */
+#define USB_CONTROL_SETUP_SIZE 8
+
+int USBAPI_DECL usb_control_setup_async(usb_dev_handle *dev, void **context);
+int USBAPI_DECL usb_control_fill_setup(char *bytes, int requesttype, int request, int value, int index, int size);
+
+/* Submits several contexts at once, as if by usb_submit_async() for each
+ * entry. The in-flight accounting is updated once for the batch. result
+ * is set to 0 or a negative errno per entry; returns the number of
+ * transfers submitted.
+ */
+struct usb_async_submission
+{
+	void *context;
+	char *bytes;
+	int size;
+	int result;
+};
+
+int USBAPI_DECL usb_submit_async_many(struct usb_async_submission *submissions, int count);
+
+/* Isochronous packet results
+ * After an isochronous context was reaped, usb_isochronous_get_results()
+ * fills one entry per packet of the last submit and returns the packet
+ * count. Packets that failed have a length of 0 and a negative errno
+ * status. The reap result is the sum of the packet lengths.
+ * In compact mode, set with usb_isochronous_set_compact() while the
+ * context is idle, the payloads are packed at the start of the buffer as
+ * the transfer completes, so the first reap result bytes are all data.
+ * Compact mode is only available on IN endpoints.
+ */
+struct usb_iso_packet_result
+{
+	int offset;		/* offset of the packet data in the submitted buffer */
+	int length;		/* bytes received or sent */
+	int status;		/* 0 or a negative errno */
+};
+
+int USBAPI_DECL usb_isochronous_set_compact(void *context, int enable);
+int USBAPI_DECL usb_isochronous_get_results(void *context, struct usb_iso_packet_result *results, int max);
+
+/* Isochronous streams
+ * A stream keeps depth transfers of packets packets of up to pktsize
+ * bytes scheduled back to back and resubmits each transfer as soon as it
+ * completes. Packets are passed to callback, which runs on an event thread
+ * with the stream locked: for IN endpoints with the received packets, for
+ * OUT endpoints to fill the next transfer (it may shorten the packet
+ * lengths). A non-zero return stops resubmitting that transfer. Because
+ * the stream is locked, callback must not call usb_iso_stream_ functions
+ * on its own stream; they would deadlock. Without a callback the stream
+ * goes through a ring of ring_size bytes, read with
+ * usb_iso_stream_read() or filled with usb_iso_stream_write(); an OUT
+ * stream then starts with the first write.
+ * underruns counts transfers that completed with nothing else scheduled
+ * and OUT transfers the ring could not fill; overruns counts IN transfers
+ * dropped because the ring was full.
+ */
+typedef int (USBAPI_DECL *usb_iso_stream_callback)(void *user_data, unsigned char *buffer,
+	struct usb_iso_packet_result *packets, int count);
+
+struct usb_iso_stream_params
+{
+	int pktsize;
+	int packets;		/* packets per transfer */
+	int depth;			/* transfers kept in flight */
+	int ring_size;
+	usb_iso_stream_callback callback;
+	void *user_data;
+};
+
+struct usb_iso_stream_stats
+{
+	uint64_t transfers;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t packet_errors;
+	uint64_t underruns;
+	uint64_t overruns;
+};
+
+int USBAPI_DECL usb_iso_stream_open(usb_dev_handle *dev, void **stream, unsigned char ep, const struct usb_iso_stream_params *params);
+int USBAPI_DECL usb_iso_stream_read(void *stream, char *bytes, int size, int timeout);
+int USBAPI_DECL usb_iso_stream_write(void *stream, char *bytes, int size, int timeout);
+int USBAPI_DECL usb_iso_stream_get_stats(void *stream, struct usb_iso_stream_stats *stats, int reset);
+int USBAPI_DECL usb_iso_stream_close(void **stream);
+
+/* Preallocates count transfer contexts for dev. The usb_*_setup_async()
+ * functions take contexts from this pool and usb_free_async() returns them.
+ * Isochronous contexts are pooled only if max_iso_packets is non-zero and
+ * then accept at most max_iso_packets packets per submit.
+ */
+int USBAPI_DECL usb_setup_async_pool(usb_dev_handle *dev, int count, int max_iso_packets);
+
+/* Completion queues
+ * Contexts attached to a queue report their completions to it instead of
+ * to usb_reap_async(). One call to usb_reap_async_many() collects the
+ * completions of any number of contexts. A queue must be reaped from one
+ * thread at a time. A context freed with usb_free_async() while it is still
+ * in flight is not reported; the queue releases it when it completes.
+ */
+struct usb_async_completion
+{
+	void *context;	/* the completed transfer context */
+	int result;		/* bytes transferred or a negative errno, see usb_reap_async() */
+};
+
+int USBAPI_DECL usb_async_queue_create(void **queue, int size);
+int USBAPI_DECL usb_async_queue_free(void **queue);
+int USBAPI_DECL usb_async_queue_attach(void *context, void *queue);
+int USBAPI_DECL usb_reap_async_many(void *queue, struct usb_async_completion *completions, int max, int timeout);
+
+/* Returns a file descriptor that polls readable while completions are
+ * waiting in queue, so the queue can be watched with select/poll/epoll
+ * next to other descriptors. Reap it with usb_reap_async_many() and a
+ * zero timeout; do not read from it. The fd is an eventfd where
+ * available and a pipe otherwise, and is closed by usb_async_queue_free().
+ * To watch a single context, attach it to a queue of its own.
+ */
+int USBAPI_DECL usb_async_queue_get_fd(void *queue);
+
+/* Completion callbacks
+ * usb_async_set_callback() makes an idle context report its completions
+ * by calling callback from the event handling thread instead of through
+ * usb_reap_async() or a completion queue; NULL restores reaping. result is
+ * the number of bytes transferred or a negative errno, as returned by
+ * usb_reap_async(). Without flags the context is idle again when the
+ * callback runs and may be submitted from it. With USB_ASYNC_RESUBMIT the
+ * same buffer is submitted again after every successful completion until
+ * the callback returns non-zero, a transfer fails or it is cancelled with
+ * usb_cancel_async(). The callback must not block.
+ */
+#define USB_ASYNC_RESUBMIT	0x01
+
+typedef int (USBAPI_DECL *usb_async_callback)(void *context, int result, void *user_data);
+
+int USBAPI_DECL usb_async_set_callback(void *context, usb_async_callback callback, void *user_data, int flags);
+
+/* External event handling
+ * With usb_init_params.external_events set, the application runs the
+ * async completions on its own event loop: it polls the fds returned by
+ * usb_get_pollfds() with the timeout from usb_get_next_timeout() (-1 if
+ * there is none) and calls usb_handle_events() when either fires.
+ * usb_handle_events() does not block; completions are delivered on the
+ * calling thread. The fds may change when devices are opened or closed.
+ * usb_get_pollfds() fills in up to max entries and returns the total
+ * number of fds, or -ENOSYS where the platform has none to poll.
+ */
+struct usb_pollfd
+{
+	int fd;
+	short events;	/* POLLIN, POLLOUT */
+};
+
+int USBAPI_DECL usb_get_pollfds(struct usb_pollfd *fds, int max);
+int USBAPI_DECL usb_get_next_timeout(int *timeout);
+int USBAPI_DECL usb_handle_events(void);
+
+/* Vectored bulk I/O
+ * Transfers the concatenation of the iovec buffers as one bulk transfer
+ * without staging it in a contiguous buffer. Only the bytes around segment
+ * boundaries that are not a multiple of wMaxPacketSize are copied. Writes
+ * keep all segments in flight at once. Reads fill the segments in order
+ * and stop at the first short packet. Return the number of bytes
+ * transferred or a negative errno, as usb_bulk_write()/usb_bulk_read().
+ * The layout matches struct iovec of <sys/uio.h>.
+ */
+struct usb_iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+
+int USBAPI_DECL usb_bulk_writev(usb_dev_handle *dev, int ep, const struct usb_iovec *iov, int iovcnt, int timeout);
+int USBAPI_DECL usb_bulk_readv(usb_dev_handle *dev, int ep, const struct usb_iovec *iov, int iovcnt, int timeout);
+
+/* Bulk streams
+ * A stream keeps depth transfers of chunk bytes in flight on a bulk
+ * endpoint. On an IN endpoint all chunks are read ahead; usb_stream_read()
+ * returns the data of one transfer at a time like usb_bulk_read(); a
+ * chunk that fails to read ahead again is reported by the next call. chunk
+ * must be a multiple of wMaxPacketSize. On an OUT endpoint
+ * usb_stream_write() queues the data as transfers of at most chunk bytes
+ * and returns without waiting for them; errors of these transfers are
+ * returned by the next usb_stream_write() or usb_stream_flush().
+ * usb_stream_flush() waits for all queued writes. usb_stream_close()
+ * cancels whatever is still in flight; a stream may still be closed after
+ * its handle. A timeout of 0 waits forever.
+ */
+int USBAPI_DECL usb_stream_open(usb_dev_handle *dev, void **stream, unsigned char ep, int depth, int chunk);
+int USBAPI_DECL usb_stream_read(void *stream, char *bytes, int size, int timeout);
+int USBAPI_DECL usb_stream_write(void *stream, char *bytes, int size, int timeout);
+int USBAPI_DECL usb_stream_flush(void *stream, int timeout);
+int USBAPI_DECL usb_stream_close(void **stream);
+
+/* Interrupt polling
+ * A poller keeps depth transfers of report_size bytes queued on an
+ * interrupt IN endpoint and resubmits each one as soon as it completes, so
+ * no report is lost while the reading thread is descheduled. Reports are
+ * stamped with the microseconds of a monotonic clock when they complete.
+ * They are passed to callback, which runs on the event thread; a non-zero
+ * return stops resubmitting that transfer. The callback may call
+ * usb_interrupt_poll_get_stats() but not usb_interrupt_poll_close(), which
+ * waits for it to return. Without a callback they go
+ * through a ring of ring_reports reports, read with
+ * usb_interrupt_poll_read() by one thread at a time; the ring is lock-free
+ * for the reader. With USB_INTERRUPT_POLL_LATEST only the freshest report
+ * is kept and each read returns a report newer than the last one read.
+ * dropped counts reports that found the ring full or replaced an unread
+ * latest report; errors counts failed transfers. A timeout of 0 waits
+ * forever.
+ */
+#define USB_INTERRUPT_POLL_LATEST	0x01
+
+typedef int (USBAPI_DECL *usb_interrupt_poll_callback)(void *user_data,
+	const unsigned char *report, int length, uint64_t timestamp_us);
+
+struct usb_interrupt_poll_params
+{
+	int report_size;
+	int depth;			/* transfers kept queued */
+	int ring_reports;
+	int flags;			/* USB_INTERRUPT_POLL_ */
+	usb_interrupt_poll_callback callback;
+	void *user_data;
+};
+
+struct usb_interrupt_poll_stats
+{
+	uint64_t reports;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t dropped;
+};
+
+int USBAPI_DECL usb_interrupt_poll_open(usb_dev_handle *dev, void **poll, unsigned char ep, const struct usb_interrupt_poll_params *params);
+int USBAPI_DECL usb_interrupt_poll_read(void *poll, char *bytes, int size, uint64_t *timestamp_us, int timeout);
+int USBAPI_DECL usb_interrupt_poll_get_stats(void *poll, struct usb_interrupt_poll_stats *stats, int reset);
+int USBAPI_DECL usb_interrupt_poll_close(void **poll);
+
+/* Transfer buffers
+ * usb_alloc_buffer() returns size bytes for transfers on dev. Where libusb
+ * supports it (usbfs on Linux) the memory is mapped from the kernel, which
+ * then does not copy the data of transfers from and to it; otherwise it is
+ * page aligned heap memory. The buffers may be passed to any transfer call
+ * on dev. Buffers left when dev is closed are freed by usb_close(), which
+ * then first cancels and waits for the async transfers in flight on dev.
+ * usb_alloc_buffer() returns NULL and sets errno on failure.
+ */
+void * USBAPI_DECL usb_alloc_buffer(usb_dev_handle *dev, size_t size);
+int USBAPI_DECL usb_free_buffer(usb_dev_handle *dev, void *buffer);
+
+/* copies the statistics of an endpoint and optionally resets them;
+ * fails with EOPNOTSUPP unless usb_init_params.endpoint_stats was set */
+int USBAPI_DECL usb_get_endpoint_stats(usb_dev_handle *dev, int ep, struct usb_endpoint_stats *stats, int reset);
+unsigned int USBAPI_DECL usb_stats_bucket_us(int bucket);
+
+/* reserved may be NULL or point to a struct usb_init_params */
 int USBAPI_DECL usb_initex(void* reserved);
 void USBAPI_DECL usb_exit(void);
 
@@ -54,7 +54,100 @@ struct usb_dev_handle {
 	 * which is used for usb_set_altinterface(). we clone the buggy behaviour
 	 * here. */
 	int last_claimed_interface;
+
+	/* preallocated async transfer contexts, see usb_setup_async_pool() */
+	struct usb_async_pool *async_pool;
+
+	/* endpoint statistics, if enabled by usb_initex() */
+	struct usbi_stats *stats;
+
+	/* async contexts and transfers in flight, see usb_cancel_endpoint() */
+	struct usbi_inflight *inflight;
+
+	/* buffers from usb_alloc_buffer(), set up by the first one */
+	struct usbi_buffers *volatile buffers;
+
+	/* idle transfer of the synchronous calls, if any */
+	struct usbi_sync_io *volatile sync_io;
+};
+
+/* Device access is routed through a backend so that the libusb-1.0 calls
+ * can be replaced (see core_sim.c). Unless noted otherwise the operations
+ * return libusb-1.0 error codes, which the callers convert with
+ * compat_err(). */
+struct usbi_backend {
+	const char *name;
+
+	int (*init)(const struct usb_init_params *params);
+	void (*exit)(void);
+
+	/* returns the busses in a new list; the caller diffs and frees it */
+	int (*find_busses)(struct usb_bus **ret);
+	/* updates the devices of usb_busses, returns the number of changes or
+	 * a negative errno */
+	int (*find_devices)(void);
+
+	int (*open)(usb_dev_handle *udev);
+	void (*close)(usb_dev_handle *udev);
+	int (*set_configuration)(usb_dev_handle *udev, int configuration);
+	int (*claim_interface)(usb_dev_handle *udev, int interface);
+	int (*release_interface)(usb_dev_handle *udev, int interface);
+	int (*set_interface_alt_setting)(usb_dev_handle *udev, int interface,
+		int alternate);
+	int (*clear_halt)(usb_dev_handle *udev, unsigned char ep);
+	int (*reset_device)(usb_dev_handle *udev);
+	int (*kernel_driver_active)(usb_dev_handle *udev, int interface);
+	int (*detach_kernel_driver)(usb_dev_handle *udev, int interface);
+
+	int (*control_transfer)(usb_dev_handle *udev, uint8_t bmRequestType,
+		uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		unsigned char *data, uint16_t wLength, unsigned int timeout);
+	int (*bulk_transfer)(usb_dev_handle *udev, unsigned char ep,
+		unsigned char *data, int length, int *actual_length,
+		unsigned int timeout);
+	int (*interrupt_transfer)(usb_dev_handle *udev, unsigned char ep,
+		unsigned char *data, int length, int *actual_length,
+		unsigned int timeout);
+	int (*get_string_descriptor_ascii)(usb_dev_handle *udev,
+		uint8_t desc_index, unsigned char *data, int length);
+
+	/* asynchronous transfers are described by a libusb_transfer from
+	 * libusb_alloc_transfer() and complete through its callback from
+	 * within handle_events_locked() */
+	int (*submit_transfer)(struct libusb_transfer *transfer);
+	int (*cancel_transfer)(struct libusb_transfer *transfer);
+
+	void (*lock_events)(void);
+	void (*unlock_events)(void);
+	int (*event_handling_ok)(void);
+	int (*handle_events_locked)(struct timeval *tv);
+	/* handles events until *completed is set or tv has elapsed; unlike
+	 * handle_events_locked() it may be called while another thread is
+	 * handling events */
+	int (*handle_events_completed)(struct timeval *tv, int *completed);
+
+	/* fills in up to max of the fds to poll for events and returns how
+	 * many there are */
+	int (*get_pollfds)(struct usb_pollfd *fds, int max);
+	/* returns 1 and the time until the next internal timeout in tv, or 0
+	 * if there is none */
+	int (*get_next_timeout)(struct timeval *tv);
+
+	/* returns size bytes of transfer memory the kernel maps for udev, or
+	 * NULL where there is none; freed with dev_mem_free() */
+	void *(*dev_mem_alloc)(usb_dev_handle *udev, size_t size);
+	void (*dev_mem_free)(usb_dev_handle *udev, void *buffer, size_t size);
 };
 
+extern struct usb_bus *usb_busses;
+
+/* hash index over the devices in usb_busses; keep in sync when linking
+ * devices into or out of bus->devices */
+int usbi_device_index_add(struct usb_device *dev);
+void usbi_device_index_remove(struct usb_device *dev);
+struct usb_device *usbi_device_index_find(unsigned int bus_num, unsigned int devnum);
+
+extern const struct usbi_backend usbi_sim_backend;
+
 #endif
 